@@ -0,0 +1,164 @@
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#include <stdint.h>
+
+/*
+ * the few atomics the lock library needs. each one uses the ARMv8.1 LSE
+ * instruction when the CPU has it and an LDXR/STXR loop otherwise, the
+ * choice is a branch on cpu_has_lse, set once at boot. the kernel is
+ * built for plain ARMv8.0, so the LSE forms are enabled per asm block.
+ */
+
+extern int cpu_has_lse;
+void atomic_init(void);         /* reads ID_AA64ISAR0_EL1, boot CPU */
+
+#define LSE ".arch_extension lse\n"
+
+static inline uint32_t atomic_fetch_add_acquire(volatile uint32_t *p, uint32_t v)
+{
+    uint32_t old, tmp, fail;
+    if (cpu_has_lse) {
+        __asm__ volatile(LSE "ldadda %w1, %w0, [%2]"
+                         : "=r"(old) : "r"(v), "r"(p) : "memory");
+        return old;
+    }
+    __asm__ volatile(
+        "1: ldaxr   %w0, [%3]\n"
+        "   add     %w1, %w0, %w4\n"
+        "   stxr    %w2, %w1, [%3]\n"
+        "   cbnz    %w2, 1b\n"
+        : "=&r"(old), "=&r"(tmp), "=&r"(fail) : "r"(p), "r"(v) : "memory");
+    return old;
+}
+
+static inline uint32_t atomic_fetch_add_release(volatile uint32_t *p, uint32_t v)
+{
+    uint32_t old, tmp, fail;
+    if (cpu_has_lse) {
+        __asm__ volatile(LSE "ldaddl %w1, %w0, [%2]"
+                         : "=r"(old) : "r"(v), "r"(p) : "memory");
+        return old;
+    }
+    __asm__ volatile(
+        "1: ldxr    %w0, [%3]\n"
+        "   add     %w1, %w0, %w4\n"
+        "   stlxr   %w2, %w1, [%3]\n"
+        "   cbnz    %w2, 1b\n"
+        : "=&r"(old), "=&r"(tmp), "=&r"(fail) : "r"(p), "r"(v) : "memory");
+    return old;
+}
+
+/* returns what was in *p, the store happened if that equals old */
+static inline uint32_t atomic_cmpxchg_acquire(volatile uint32_t *p, uint32_t old, uint32_t new)
+{
+    uint32_t cur, fail;
+    if (cpu_has_lse) {
+        cur = old;
+        __asm__ volatile(LSE "casa %w0, %w1, [%2]"
+                         : "+r"(cur) : "r"(new), "r"(p) : "memory");
+        return cur;
+    }
+    __asm__ volatile(
+        "1: ldaxr   %w0, [%2]\n"
+        "   cmp     %w0, %w3\n"
+        "   b.ne    2f\n"
+        "   stxr    %w1, %w4, [%2]\n"
+        "   cbnz    %w1, 1b\n"
+        "2:\n"
+        : "=&r"(cur), "=&r"(fail) : "r"(p), "r"(old), "r"(new) : "memory", "cc");
+    return cur;
+}
+
+static inline uint64_t atomic_xchg64(volatile uint64_t *p, uint64_t new)
+{
+    uint64_t old;
+    uint32_t fail;
+    if (cpu_has_lse) {
+        __asm__ volatile(LSE "swpal %1, %0, [%2]"
+                         : "=r"(old) : "r"(new), "r"(p) : "memory");
+        return old;
+    }
+    __asm__ volatile(
+        "1: ldaxr   %0, [%2]\n"
+        "   stlxr   %w1, %3, [%2]\n"
+        "   cbnz    %w1, 1b\n"
+        : "=&r"(old), "=&r"(fail) : "r"(p), "r"(new) : "memory");
+    return old;
+}
+
+static inline uint64_t atomic_cmpxchg_release64(volatile uint64_t *p, uint64_t old, uint64_t new)
+{
+    uint64_t cur;
+    uint32_t fail;
+    if (cpu_has_lse) {
+        cur = old;
+        __asm__ volatile(LSE "casl %0, %1, [%2]"
+                         : "+r"(cur) : "r"(new), "r"(p) : "memory");
+        return cur;
+    }
+    __asm__ volatile(
+        "1: ldxr    %0, [%2]\n"
+        "   cmp     %0, %3\n"
+        "   b.ne    2f\n"
+        "   stlxr   %w1, %4, [%2]\n"
+        "   cbnz    %w1, 1b\n"
+        "2:\n"
+        : "=&r"(cur), "=&r"(fail) : "r"(p), "r"(old), "r"(new) : "memory", "cc");
+    return cur;
+}
+
+/*
+ * waiting: an exclusive load arms this CPU's monitor on the line, any
+ * store to it from elsewhere clears the monitor and raises the event
+ * that ends the wfe. so a waiter sleeps until the value may have changed.
+ */
+static inline uint32_t load_exclusive32(const volatile uint32_t *p)
+{
+    uint32_t v;
+    __asm__ volatile("ldaxr %w0, [%1]" : "=r"(v) : "r"(p) : "memory");
+    return v;
+}
+
+static inline uint16_t load_exclusive16(const volatile uint16_t *p)
+{
+    uint32_t v;
+    __asm__ volatile("ldaxrh %w0, [%1]" : "=r"(v) : "r"(p) : "memory");
+    return (uint16_t)v;
+}
+
+static inline uint64_t load_exclusive64(const volatile uint64_t *p)
+{
+    uint64_t v;
+    __asm__ volatile("ldaxr %0, [%1]" : "=r"(v) : "r"(p) : "memory");
+    return v;
+}
+
+static inline uint32_t load_acquire32(const volatile uint32_t *p)
+{
+    uint32_t v;
+    __asm__ volatile("ldar %w0, [%1]" : "=r"(v) : "r"(p) : "memory");
+    return v;
+}
+
+static inline void store_release32(volatile uint32_t *p, uint32_t v)
+{
+    __asm__ volatile("stlr %w0, [%1]" :: "r"(v), "r"(p) : "memory");
+}
+
+static inline void store_release16(volatile uint16_t *p, uint16_t v)
+{
+    __asm__ volatile("stlrh %w0, [%1]" :: "r"((uint32_t)v), "r"(p) : "memory");
+}
+
+static inline void cpu_wfe(void)
+{
+    __asm__ volatile("wfe" ::: "memory");
+}
+
+static inline void cpu_sev(void)
+{
+    __asm__ volatile("dsb ishst\n sev" ::: "memory");
+}
+
+#endif
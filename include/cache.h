@@ -0,0 +1,34 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * cache maintenance. the by-VA helpers work on kernel or user addresses
+ * that are mapped in the current translation regime and round out to
+ * whole lines. the set/way ones only make sense on this CPU with the
+ * caches off or at boot, they are not broadcast.
+ */
+
+void cache_init(void);          /* read line sizes from CTR_EL0 */
+void cache_enable(void);        /* SCTLR_EL1.C and .I, MMU must be on */
+int cache_enabled(void);
+
+/* by virtual address, to the point of coherency */
+void dcache_clean_range(const void *start, size_t size);
+void dcache_inval_range(const void *start, size_t size);
+void dcache_flush_range(const void *start, size_t size);   /* clean + invalidate */
+
+/* make freshly written instructions visible to instruction fetch */
+void icache_sync_range(const void *start, size_t size);
+void icache_inval_all(void);
+
+/* by set/way, every level up to the point of coherency */
+void dcache_inval_all(void);
+void dcache_flush_all(void);
+
+/* boot benchmark: copy bandwidth in MiB/s with whatever caching is on now */
+uint64_t cache_bench(void);
+
+#endif
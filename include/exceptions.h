@@ -1,7 +1,13 @@
 #ifndef _EXCEPTIONS_H
 #define _EXCEPTIONS_H
 
-unsigned long handle_sync_exception(unsigned long user_x0, unsigned long user_x1, unsigned long user_x2, unsigned long user_x8);
-void handle_irq(void);
+struct trap_frame;
+
+unsigned long handle_sync_exception(unsigned long user_x0, unsigned long user_x1, unsigned long user_x2, unsigned long user_x8,
+                                    struct trap_frame *tf);
+void handle_irq(struct trap_frame *tf);
+
+/* the exception was taken from EL0t */
+#define TF_FROM_USER(tf) (((tf)->spsr & 0xf) == 0)
 
 #endif 
\ No newline at end of file
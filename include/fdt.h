@@ -0,0 +1,21 @@
+#ifndef FDT_H
+#define FDT_H
+
+#include <stdint.h>
+
+#define FDT_MAGIC 0xd00dfeed
+
+/* physical address of the device tree blob QEMU hands us in x0 (boot.S) */
+extern uint64_t boot_dtb;
+
+int fdt_valid(const void *fdt);
+uint32_t fdt_total_size(const void *fdt);
+int fdt_memory_range(const void *fdt, uint64_t *base, uint64_t *size);
+
+/* PSCI conduit and the CPUs it can start */
+#define FDT_PSCI_HVC 1
+#define FDT_PSCI_SMC 2
+int fdt_psci_method(const void *fdt);
+int fdt_cpus(const void *fdt, uint64_t *mpidr, int max);
+
+#endif
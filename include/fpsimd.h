@@ -0,0 +1,41 @@
+#ifndef FPSIMD_H
+#define FPSIMD_H
+
+#include <stdint.h>
+
+/*
+ * lazy FP/SIMD switching. the kernel itself is built general-regs-only,
+ * so the registers only ever hold user state. CPACR_EL1 traps EL0 FP use
+ * after a switch; the first trap loads the process's state, and a
+ * process that used FP gets its registers saved when it is switched
+ * out. a process that never touches FP has no state and never traps.
+ */
+
+/* layout shared with fpsimd.S */
+struct fpsimd_state {
+    __uint128_t v[32];          /* offset 0 */
+    uint32_t fpsr;              /* offset 512 */
+    uint32_t fpcr;              /* offset 516 */
+} __attribute__((aligned(16)));
+
+struct fpsimd_stats {
+    uint64_t restores;          /* state loaded on a trap */
+    uint64_t saves;             /* state saved on switch out */
+    uint64_t reuses;            /* still live in the registers, no trap needed */
+    uint64_t first_uses;        /* processes that started using FP */
+};
+
+struct process;
+
+void fpsimd_init_cpu(void);     /* every CPU: trap EL0 FP use */
+void fpsimd_switch(struct process *prev, struct process *next);
+int fpsimd_trap(void);          /* EC 0x07 from EL0, 0 to retry the instruction */
+int fpsimd_fork(struct process *child, struct process *parent);
+void fpsimd_release(struct process *p);
+void fpsimd_cpu_stats(int cpu, struct fpsimd_stats *out);
+
+/* fpsimd.S */
+void fpsimd_save_state(struct fpsimd_state *st);
+void fpsimd_load_state(const struct fpsimd_state *st);
+
+#endif
@@ -1,9 +1,16 @@
 #ifndef GIC_H
 #define GIC_H
 
+/* GICv2 as on QEMU virt. IDs 0-15 are SGIs, the IAR value carries the
+   sending CPU for those and has to go back to EOIR unchanged */
+#define GIC_IRQ_ID(iar)     ((iar) & 0x3ff)
+#define GIC_SPURIOUS        1020
+
 void gic_init(void);
+void gic_init_cpu(void);
 void gic_enable_interrupt(int irq);
 unsigned int gic_acknowledge_interrupt(void);
 void gic_end_interrupt(unsigned int irq);
+void gic_send_sgi(int cpu, unsigned int sgi);
 
 #endif 
\ No newline at end of file
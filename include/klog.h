@@ -0,0 +1,59 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * kernel log. a record is formatted straight into a per-CPU ring and
+ * printed later by the klogd kernel thread, so logging costs a few
+ * hundred cycles instead of the time the UART needs to send the line.
+ * records above klog_level are dropped at the call site, before any
+ * argument is formatted.
+ *
+ *     klog(KLOG_DEBUG, "Reading from fd: %d", fd);
+ *
+ * the format is ksnprintf's, see kprintf.h. one record holds one line
+ * of up to KLOG_TEXT - 1 characters, the newline is added when printed.
+ */
+
+#define KLOG_ERR        0
+#define KLOG_WARN       1
+#define KLOG_INFO       2
+#define KLOG_DEBUG      3
+
+#define KLOG_DEFAULT_LEVEL  KLOG_INFO
+
+#define KLOG_RECORDS    64      /* per CPU, a power of two */
+#define KLOG_TEXT       112
+
+extern volatile int klog_level;
+
+#define klog(level, ...)                            \
+    do {                                            \
+        if ((level) <= klog_level) {                \
+            klog_emit((level), __VA_ARGS__);        \
+        }                                           \
+    } while (0)
+
+void klog_emit(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int klog_set_level(int level);      /* returns the old level, < 0 only queries */
+
+/* counters for the shell */
+struct klog_stats {
+    uint64_t written;
+    uint64_t dropped;       /* ring full of records klogd had not printed */
+    uint64_t printed;
+};
+void klog_get_stats(struct klog_stats *out);
+
+/* the most recent records of every CPU as text, oldest first. returns the length */
+size_t klog_dump(char *buf, size_t size);
+
+/* klogd, started once the scheduler runs */
+void klog_start(void);
+void klog_poke(void);           /* kernel lock held, wakes klogd if records wait */
+int klog_need_drain(void);
+void klog_flush(void);          /* prints what is left, for a halting kernel */
+
+#endif
@@ -2,8 +2,59 @@
 #define KMALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+/* subsystem an allocation is charged to */
+enum kmem_tag {
+    KMEM_MISC = 0,
+    KMEM_VFS,
+    KMEM_ABYSSFS,
+    KMEM_NAMESPACE,
+    KMEM_PROCESS,
+    KMEM_IPC,
+    KMEM_NR_TAGS
+};
+
+#define KMEM_NR_SITES 16
+
+struct kmem_tag_stats {
+    uint64_t live_bytes;        /* requested bytes currently allocated */
+    uint64_t peak_bytes;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failures;
+};
+
+struct kmem_site_stats {
+    uint64_t site;              /* return address of the kalloc caller */
+    uint64_t live_bytes;
+    uint64_t allocs;
+    uint32_t tag;
+    uint32_t pad;
+};
+
+/* snapshot filled in by MSG_MEMINFO */
+struct kmem_info {
+    struct kmem_tag_stats tags[KMEM_NR_TAGS];
+    struct kmem_site_stats sites[KMEM_NR_SITES];
+    uint64_t live_bytes;        /* requested */
+    uint64_t reserved_bytes;    /* size class slots and page blocks backing them */
+    uint64_t peak_bytes;
+    uint64_t slab_bytes;        /* pages owned by slabs, used or not */
+    uint64_t large_bytes;       /* pages handed out for > 2 KiB requests */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t allocs_per_sec;    /* since the previous snapshot */
+    uint64_t free_pages;
+    uint64_t total_pages;
+};
+
+/* returns zeroed memory, NULL when out of memory */
 void* kalloc(size_t size);
+void* kalloc_tag(size_t size, int tag);
 void kfree(void* ptr);
 
-#endif 
\ No newline at end of file
+const char *kmem_tag_name(int tag);
+void kmem_get_info(struct kmem_info *info);
+
+#endif
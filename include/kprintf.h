@@ -0,0 +1,24 @@
+#ifndef KPRINTF_H
+#define KPRINTF_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/*
+ * freestanding printf. conversions: %d %i %u %x %X %p %s %c %%, with the
+ * flags - and 0, a field width (digits or *) and the length modifiers
+ * l, ll and z. %p prints like uart_hex(), 0x and 16 digits.
+ *
+ * ksnprintf always terminates buf when size > 0 and returns the length
+ * the whole output would have had. kprintf formats into a stack buffer
+ * and hands the line to the UART in one write, output past
+ * KPRINTF_BUF_SIZE - 1 characters is cut off.
+ */
+
+#define KPRINTF_BUF_SIZE    256
+
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+int kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
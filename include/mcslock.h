@@ -0,0 +1,31 @@
+#ifndef MCSLOCK_H
+#define MCSLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "spinlock.h"
+
+/*
+ * MCS queue lock for contended paths. every waiter spins on the locked
+ * flag of its own node, so a release touches one remote cache line
+ * instead of all of them. the node belongs to the caller (usually on its
+ * stack) and has to stay put from mcs_lock() until mcs_unlock().
+ */
+
+struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile uint32_t locked;
+};
+
+struct mcs_lock {
+    struct mcs_node *volatile tail;     /* last waiter, NULL when free */
+    LOCK_STATS_FIELD
+};
+
+#define MCS_LOCK_INIT   { .tail = NULL }
+
+void mcs_lock(struct mcs_lock *l, struct mcs_node *me);
+int mcs_trylock(struct mcs_lock *l, struct mcs_node *me);
+void mcs_unlock(struct mcs_lock *l, struct mcs_node *me);
+
+#endif
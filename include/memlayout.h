@@ -0,0 +1,25 @@
+#ifndef MEMLAYOUT_H
+#define MEMLAYOUT_H
+
+#include <stdint.h>
+
+/* QEMU virt: RAM starts at 1 GiB, the kernel is loaded at its base */
+#define RAM_BASE        0x40000000UL
+
+/* EL0 window, private to each process address space. plain RAM underneath
+   as far as the kernel is concerned */
+#define USER_BASE       0x80000000UL
+#define USER_END        0xC0000000UL
+
+/* initial user stack reservation, top of the window growing down (vma.h) */
+#define USER_STACK_TOP  USER_END
+#define USER_STACK_SIZE 0x10000UL
+
+/* the kernel runs in the TTBR1 half, all of RAM and the devices are
+   mapped there at KERNEL_VBASE + physical. TTBR0 holds user mappings only */
+#define KERNEL_VBASE    0xFFFF000000000000UL
+
+#define phys_to_virt(pa)    ((void *)((uintptr_t)(pa) + KERNEL_VBASE))
+#define virt_to_phys(va)    ((uintptr_t)(va) - KERNEL_VBASE)
+
+#endif
@@ -36,6 +36,16 @@ enum msg_type {
     MSG_PUTC,    // put character to console
     MSG_GETC,    // get character from console  
     MSG_PUTS,    // put string to console
+    MSG_MEMINFO, // kernel heap statistics into data (struct kmem_info)
+    MSG_BRK,     // move the program break to data (NULL queries), new break back in data
+    MSG_SHM_CREATE, // new shared memory object of size bytes, id in fd, address in data
+    MSG_SHM_GRANT,  // map object fd into process pid, the peer gets a MSG_SHM_GRANT queued
+    MSG_SHM_UNMAP,  // unmap the shared memory mapping at data
+    MSG_MMAP,    // map file path (MAP_PRIVATE in flags for copy-on-write), address in data, length in size
+    MSG_MUNMAP,  // unmap the file mapping at data
+    MSG_KLOG,    // recent kernel log records as text into data (size bytes), length back in size
+    MSG_KLOG_LEVEL, // set the klog level to flags (negative only queries), old level in status
+    MSG_STATS,   // kernel counters as text into data (size bytes), STATS_* report in flags, length back in size
 };
 
 #define MSG_NONBLOCK 0x01
@@ -64,14 +74,20 @@ int receive_message(struct Message *msg);
 
 #define MAX_MESSAGES 32
 
+// queued copies live in a pool, see message.c
+struct message_node {
+    struct Message msg;
+    struct message_node *next;
+};
+
 struct message_queue {
-    struct Message messages[MAX_MESSAGES];
-    int head;
-    int tail;
+    struct message_node *head;
+    struct message_node *tail;
     int count;
 };
 
 
 int queue_message(struct process *proc, struct Message *msg);
+void flush_message_queue(struct message_queue *queue);
 
 #endif
\ No newline at end of file
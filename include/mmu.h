@@ -1,8 +1,92 @@
- #ifndef _MMU_H
+#ifndef _MMU_H
 #define _MMU_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 4 KiB granule, 48 bit VA, four levels (L0..L3). L1 entries can be
+ * 1 GiB blocks, L2 entries 2 MiB blocks, L3 entries are 4 KiB pages.
+ */
+#define PT_ENTRIES      512
+#define LEVEL_SHIFT(l)  (39 - 9 * (l))
+#define LEVEL_SIZE(l)   (1UL << LEVEL_SHIFT(l))
+#define PT_INDEX(l, va) (((va) >> LEVEL_SHIFT(l)) & (PT_ENTRIES - 1))
+
+/* descriptor bits */
+#define PTE_VALID       (1ULL << 0)
+#define PTE_TABLE       (1ULL << 1)         /* L0-L2: next level table */
+#define PTE_PAGE        (1ULL << 1)         /* L3: page, not reserved */
+#define PTE_ATTR(n)     ((uint64_t)(n) << 2)
+#define PTE_USER        (1ULL << 6)         /* AP[1], EL0 access */
+#define PTE_RDONLY      (1ULL << 7)         /* AP[2] */
+#define PTE_SH_INNER    (3ULL << 8)
+#define PTE_AF          (1ULL << 10)
+#define PTE_NG          (1ULL << 11)        /* not global, tagged with the ASID */
+#define PTE_PXN         (1ULL << 53)
+#define PTE_UXN         (1ULL << 54)
+#define PTE_COW         (1ULL << 55)        /* software: read-only until written, then copied */
+#define PTE_SHARED      (1ULL << 56)        /* software: shared on purpose, fork keeps sharing */
+#define PTE_ADDR_MASK   0x0000FFFFFFFFF000ULL
+
+/* MAIR slots, see MAIR_VALUE in mmu.c */
+#define MT_NORMAL       0
+#define MT_DEVICE       1
+
+#define PROT_KERNEL     (PTE_AF | PTE_SH_INNER | PTE_ATTR(MT_NORMAL) | PTE_UXN)
+#define PROT_KERNEL_RO  (PROT_KERNEL | PTE_RDONLY | PTE_PXN)
+#define PROT_DEVICE     (PTE_AF | PTE_ATTR(MT_DEVICE) | PTE_UXN | PTE_PXN)
+#define PROT_USER_RWX   (PTE_AF | PTE_SH_INNER | PTE_ATTR(MT_NORMAL) | PTE_USER | PTE_NG | PTE_PXN)
+#define PROT_USER_RW    (PROT_USER_RWX | PTE_UXN)
+#define PROT_USER_RO    (PROT_USER_RW | PTE_RDONLY)
+
+typedef uint64_t pte_t;
+
+/* ASIDs: 8 or 16 bits wide, the generation lives above bit 16 */
+#define ASID_SHIFT      16
+#define ASID_MASK       ((1ULL << ASID_SHIFT) - 1)
+
+struct vma;
+
+/* one address space, the kernel's (TTBR1) has ASID 0 and only global mappings */
+struct mm {
+    pte_t *pgd;             /* L0 table, kernel virtual address */
+    uint64_t asid;          /* generation | asid, 0 until first switched to */
+    struct vma *vmas;       /* see vma.h */
+    uint64_t brk_start;
+    uint64_t brk;
+    uint64_t rss;           /* pages faulted in */
+};
+
+struct tlb_stats {
+    uint64_t full_flushes;  /* tlbi vmalle1is */
+    uint64_t asid_flushes;  /* tlbi aside1is */
+    uint64_t page_flushes;  /* tlbi vae1is / vaae1is */
+    uint64_t rollovers;     /* ASID generation bumps */
+    uint64_t switches;
+};
+
 void mmu_init(void);
+void mmu_init_secondary(void);
 
 uint64_t mmu_get_l1_block(int i);
 
-#endif
\ No newline at end of file
+/* page table builder */
+int mmu_map(struct mm *mm, uint64_t va, uint64_t pa, size_t size, uint64_t prot);
+int mmu_unmap(struct mm *mm, uint64_t va, size_t size);
+pte_t *mmu_walk(struct mm *mm, uint64_t va, int *level);
+uint64_t mmu_translate(struct mm *mm, uint64_t va);    /* ~0 when unmapped */
+
+/* address spaces: the kernel lives in TTBR1, these hold user mappings only */
+struct mm *mmu_kernel_mm(void);
+int mmu_new_address_space(struct mm *mm);
+int mmu_share_user(struct mm *dst, struct mm *src);     /* copy-on-write */
+int mmu_handle_cow(struct mm *mm, uint64_t va);
+void mmu_free_address_space(struct mm *mm);
+
+/* TTBR0 value for mm with a live ASID, marks mm as the running one */
+uint64_t mmu_activate(struct mm *mm);
+void mmu_switch(struct mm *mm);
+void mmu_tlb_stats(struct tlb_stats *out);
+
+#endif
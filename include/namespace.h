@@ -31,5 +31,6 @@ int unbind(const char *path);
 
 struct namespace* create_namespace(const char *old, const char *new, int flags);
 void init_process_namespace(struct proc_namespace *ns);
+void free_process_namespace(struct proc_namespace *ns);
 
 #endif 
\ No newline at end of file
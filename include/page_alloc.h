@@ -0,0 +1,55 @@
+#ifndef PAGE_ALLOC_H
+#define PAGE_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1UL << PAGE_SHIFT)
+#define PAGE_ALIGN(x)   (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+/* blocks of 2^0 .. 2^MAX_ORDER pages, 4 KiB .. 2 MiB */
+#define MAX_ORDER       9
+
+/* struct page flags */
+#define PG_RESERVED     (1 << 0)    /* not managed (kernel image, holes) */
+#define PG_BUDDY        (1 << 1)    /* head of a free buddy block */
+#define PG_HEAD         (1 << 2)    /* head of an allocated block */
+#define PG_SLAB         (1 << 3)    /* kmalloc slab page */
+#define PG_LARGE        (1 << 4)    /* kmalloc page-granular allocation */
+
+/* one per physical page frame */
+struct page {
+    uint16_t flags;
+    uint8_t order;          /* block order (PG_BUDDY, PG_HEAD) */
+    uint8_t slab_class;     /* kmalloc size class (PG_SLAB) */
+    uint16_t inuse;         /* live objects (PG_SLAB) */
+    uint16_t refcount;      /* users of an allocated block (PG_HEAD) */
+    void *freelist;         /* free objects (PG_SLAB) */
+    struct page *next;      /* free area or slab partial list */
+    struct page *prev;
+};
+
+void page_alloc_init(void);
+
+struct page *alloc_pages(unsigned int order);
+void free_pages(struct page *pg);
+
+/* shared frames, e.g. copy-on-write. put_page frees on the last reference */
+void get_page(struct page *pg);
+void put_page(struct page *pg);
+
+/* kernel virtual address variants */
+void *page_alloc(unsigned int order);
+void page_free(void *addr);
+
+struct page *virt_to_page(const void *addr);
+void *page_to_virt(struct page *pg);
+unsigned int get_order(size_t size);
+
+uint64_t page_alloc_ram_end(void);
+size_t page_alloc_free_pages(void);
+size_t page_alloc_total_pages(void);
+void page_alloc_dump(void);
+
+#endif
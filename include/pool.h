@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * fixed-size object pool. objects are cache-line aligned and recycled
+ * through a free list, the pool grows a page at a time and never shrinks.
+ */
+struct obj_pool {
+    const char *name;
+    size_t obj_size;        /* requested size, rounded up on first use */
+    void *free_list;
+    int ready;
+
+    /* statistics */
+    uint64_t hits;          /* allocations served from the free list */
+    uint64_t misses;        /* allocations that had to grow the pool */
+    size_t in_use;
+    size_t high_water;
+    size_t total;           /* objects carved out so far */
+
+    struct obj_pool *next;  /* all pools, for pool_dump_stats */
+};
+
+#define DEFINE_POOL(var, type) \
+    struct obj_pool var = { .name = #type, .obj_size = sizeof(type) }
+
+void *pool_alloc(struct obj_pool *pool);
+void pool_free(struct obj_pool *pool, void *obj);
+
+struct obj_pool *pool_list(void);
+void pool_dump_stats(void);
+
+#endif
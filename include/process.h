@@ -5,18 +5,34 @@
 #include "namespace.h"
 #include "message.h"
 #include "vfs.h"
+#include "mmu.h"
+#include "smp.h"
+#include "waitqueue.h"
 
 
 typedef unsigned char uint8_t;
 
 
-#define MAX_PROCESSES     4
 #define PROCESS_STACK_SIZE 4096
-#define PROCESS_LOAD_ADDR 0x40100000
-#define PROCESS_STACK_TOP 0x40000000  
 
 typedef int pid_t;
 
+/* run queue priorities, 0 is the most urgent */
+#define NR_PRIORITIES     32
+#define PRIO_DEFAULT      16
+
+/* every process traps onto its own kernel stack */
+#define KSTACK_SIZE       0x4000
+
+/* default time slice in timer ticks, see sched_set_slice() */
+#define SCHED_SLICE_TICKS 10
+
+/* initial buckets of the pid hash, a power of two. it doubles as it fills */
+#define PID_HASH_MIN      16
+
+/* how often a CPU with waiting processes looks for a lighter one */
+#define SCHED_BALANCE_TICKS 4
+
 
 enum process_state {
     PROC_READY,
@@ -29,13 +45,31 @@ enum process_state {
 
 typedef struct process process_t;
 
+struct fpsimd_state;
+
+/* layout is shared with context_switch.S, keep the offsets in sync */
 typedef struct context {
+    unsigned long regs[10];     /* x19-x28, offset 0 */
+    unsigned long fp;           /* x29, offset 80 */
+    unsigned long lr;           /* x30, offset 88 */
+    unsigned long sp;           /* offset 96 */
+    unsigned long daif;         /* offset 104 */
+    unsigned long ttbr0;        /* offset 112, root | ASID, set by schedule */
     unsigned long pc;
-    unsigned long sp;
-    unsigned long lr;
     unsigned long x[31];  
 } context_t;
 
+/* user state saved on exception entry, layout shared with exceptions.S */
+struct trap_frame {
+    unsigned long x[31];        /* offset 0 */
+    unsigned long sp_el0;       /* offset 248 */
+    unsigned long elr;          /* offset 256 */
+    unsigned long spsr;         /* offset 264 */
+};
+
+#define SPSR_EL0T       0x0     /* EL0, interrupts unmasked */
+#define DAIF_MASKED     0x3c0
+
 #define MAX_MOUNTS 16  
 
 struct mount_point {
@@ -51,7 +85,30 @@ struct process {
     struct proc_namespace ns;
     context_t ctx;
     unsigned long sp;  
-    struct process *next;
+    void *stack;        /* PROCESS_STACK_SIZE block from page_alloc */
+    void *kstack;       /* KSTACK_SIZE, exceptions from EL0 land at its top */
+    struct trap_frame *tf;      /* user registers, top of kstack */
+    unsigned long slice_end;    /* counter value at which it is preempted */
+    struct fpsimd_state *fpsimd;    /* allocated on first FP use, see fpsimd.h */
+    int fpsimd_cpu;     /* CPU its FP state was last loaded on */
+    struct mm mm;       /* page tables and ASID, see mmu.h */
+    struct process *next;       /* process_list */
+    struct process *prev;
+    struct process *hash_next;  /* pid hash chain */
+    struct process *parent;     /* NULL for top level and orphaned processes */
+    struct process *children;   /* live children, linked through sibling */
+    struct process *zombies;    /* exited children nobody has waited for yet */
+    struct process *sibling;
+    struct process **sibling_pprev;
+    int wait_blocked;   /* in MSG_WAIT, woken by a child's exit */
+    struct wait_queue *wait_on;     /* what it sleeps on, see waitqueue.h */
+    size_t scratch_mark;            /* scratch level at syscall entry, see scratch.h */
+    struct process *wait_next;
+    int priority;       /* 0 .. NR_PRIORITIES - 1 */
+    int cpu;            /* whose run queue it goes on */
+    int on_rq;
+    struct process *rq_next;    /* run queue links, only while PROC_READY */
+    struct process *rq_prev;
     int exit_status;
     struct message_queue msg_queue;
     int msg_blocked;
@@ -63,11 +120,45 @@ typedef struct process process_t;
 /* Functions to initialize process management, create processes, and schedule */
 void process_init(void);
 process_t* process_create(void (*entry)(void));
+process_t* kthread_create(void (*fn)(void));
 void schedule(void);
 void process_exit(int status);
 
-/* Global pointer to the currently running process */
-extern process_t *current_process;
+/* every state change goes through here, it keeps the run queues in step */
+void set_process_state(struct process *p, enum process_state state);
+
+/* preemption, driven from the timer interrupt */
+void sched_tick(void);
+int sched_need_resched(void);
+void sched_set_slice(unsigned int ticks);
+
+/* time spent in the idle task's wfi, in counter cycles */
+struct idle_stats {
+    unsigned long idle_cycles;
+    unsigned long wakeups;      /* wfi returns */
+    unsigned long entries;      /* switches to the idle task */
+};
+void sched_idle_stats(int cpu, struct idle_stats *out);
+
+/* load balancing, per CPU */
+struct sched_stats {
+    unsigned long steals;           /* pulled with an empty queue */
+    unsigned long migrations;       /* processes moved onto this CPU */
+    unsigned long balance_kicks;    /* pull requests sent to lighter CPUs */
+};
+void sched_cpu_stats(int cpu, struct sched_stats *out);
+
+/* per-CPU scheduler state, see smp.c */
+unsigned long sched_init_cpu(int cpu);          /* idle stack top, 0 on failure */
+void sched_start_cpu(void) __attribute__((noreturn));
+int sched_pick_cpu(void);
+void sched_ipi(void);
+
+/* p resumes in EL0 at pc with sp the next time it is switched to */
+int process_start_user(struct process *p, unsigned long pc, unsigned long sp);
+
+/* the process running on this CPU */
+#define current_process (this_cpu()->current)
 extern struct process *process_list;  
 
 
@@ -79,6 +170,8 @@ struct process* create_process(void);
 pid_t get_pid(struct process *p);
 void exit_process(int status);  
 struct process* find_process(int pid);  
+int handle_fork_message(struct Message *msg);
+int handle_wait_message(struct Message *msg);
 
 
 void switch_to_process(struct process *next);
@@ -92,4 +185,9 @@ void gic_init(void);
 
 int handle_exec_message(struct Message *msg);
 
+/* user memory */
+int process_load_image(struct process *p, unsigned long va, const void *src, size_t size);
+unsigned long process_setup_user_stack(struct process *p);
+void reap_process(struct process *p);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,28 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <stdint.h>
+#include "spinlock.h"
+
+/*
+ * reader-writer spinlock in one word: bit 31 is the writer, the low bits
+ * count readers. a writer claims bit 31 first and then waits for the
+ * readers inside to leave, new readers wait while it is set, so a stream
+ * of readers cannot starve writers. waiting is done in wfe.
+ */
+
+#define RW_WRITER       0x80000000U
+
+typedef struct {
+    volatile uint32_t cnt;
+    LOCK_STATS_FIELD
+} rwlock_t;
+
+#define RWLOCK_INIT     { .cnt = 0 }
+
+void read_lock(rwlock_t *l);
+void read_unlock(rwlock_t *l);
+void write_lock(rwlock_t *l);
+void write_unlock(rwlock_t *l);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+
+/*
+ * per-CPU bump arena for temporary buffers (paths, copy chunks, dirents).
+ * take a mark, allocate, release the mark when done. handle_sync_exception
+ * releases everything a syscall left behind when it returns.
+ *
+ * a mark remembers the arena it was taken on, a syscall that slept and
+ * woke up on another CPU still releases the right one. buffers must not
+ * be held across a sleep: other syscalls on that CPU take and release
+ * marks below them meanwhile. sleep_on() complains if one is.
+ */
+
+#define SCRATCH_NO_MARK     ((size_t)-1)
+
+void *scratch_alloc(size_t size);
+size_t scratch_mark(void);
+void scratch_release(size_t mark);
+int scratch_held(size_t mark);      /* buffers taken since mark are still live */
+
+#endif
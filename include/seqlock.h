@@ -0,0 +1,59 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+#include "atomic.h"
+#include "spinlock.h"
+
+/*
+ * sequence lock for small, read-mostly data. writers serialise on the
+ * spinlock and make seq odd while they change the data, readers never
+ * write shared memory and simply retry if seq moved under them:
+ *
+ *     do {
+ *         seq = read_seqbegin(&s);
+ *         ... copy the data ...
+ *     } while (read_seqretry(&s, seq));
+ *
+ * readers must not follow pointers out of the protected data, they may
+ * see it torn until the retry check.
+ */
+
+typedef struct {
+    volatile uint32_t seq;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INIT    { .seq = 0, .lock = SPINLOCK_INIT }
+
+static inline uint32_t read_seqbegin(const seqlock_t *s)
+{
+    uint32_t seq;
+    while ((seq = load_acquire32(&s->seq)) & 1) {
+        if (load_exclusive32(&s->seq) & 1) {
+            cpu_wfe();
+        }
+    }
+    return seq;
+}
+
+static inline int read_seqretry(const seqlock_t *s, uint32_t start)
+{
+    __asm__ volatile("dmb ishld" ::: "memory");
+    return s->seq != start;
+}
+
+static inline void write_seqlock(seqlock_t *s)
+{
+    spin_lock(&s->lock);
+    s->seq = s->seq + 1;
+    __asm__ volatile("dmb ishst" ::: "memory");
+}
+
+static inline void write_sequnlock(seqlock_t *s)
+{
+    store_release32(&s->seq, s->seq + 1);
+    spin_unlock(&s->lock);
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct process;
+
+/*
+ * shared memory objects. a set of pages that several address spaces map
+ * at once, so bulk data moves between processes without a kernel copy.
+ * the object lives until the last mapping of it goes away.
+ */
+
+#define SHM_MAX_OBJECTS 32
+#define SHM_MAX_SIZE    (2UL << 20)
+
+#define SHM_RDONLY      0x02    /* Message.flags for MSG_SHM_GRANT */
+
+struct shm_object {
+    int id;                 /* 0 when the slot is free */
+    size_t npages;
+    void **pages;           /* kernel addresses, one ref each */
+    int refs;               /* mappings */
+};
+
+struct shm_object *shm_create(size_t size);
+struct shm_object *shm_lookup(int id);
+void shm_get(struct shm_object *obj);
+void shm_put(struct shm_object *obj);
+
+/* map obj into p, returns the user address or 0 */
+uint64_t shm_map(struct shm_object *obj, struct process *p, int rdonly);
+int shm_unmap(struct process *p, uint64_t addr);
+int shm_is_mapped(struct shm_object *obj, struct process *p);
+int shm_is_writable(struct shm_object *obj, struct process *p);   /* mapped read-write */
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+#define NR_CPUS         8
+
+/* SGI numbers, see handle_irq() */
+#define IPI_RESCHEDULE  0
+
+struct process;
+struct mm;
+
+/*
+ * per-CPU state, TPIDR_EL1 points at this CPU's entry. the scheduler
+ * keeps its run queues in process.c, indexed by id.
+ */
+struct cpu {
+    int id;                     /* index into cpus[] */
+    int online;
+    uint64_t mpidr;             /* affinity, the PSCI target */
+    struct process *current;
+    struct mm *active_mm;       /* see mmu_activate() */
+};
+
+extern struct cpu cpus[NR_CPUS];
+
+static inline struct cpu *this_cpu(void)
+{
+    struct cpu *c;
+    __asm__ volatile("mrs %0, tpidr_el1" : "=r"(c));
+    return c;
+}
+
+static inline int smp_processor_id(void)
+{
+    return this_cpu()->id;
+}
+
+void smp_init(void);                /* boot CPU, before anything per-CPU is used */
+void smp_boot_secondaries(void);    /* PSCI CPU_ON for every CPU in the device tree */
+int smp_num_cpus(void);
+void smp_send_reschedule(int cpu);
+
+/*
+ * one lock around the kernel: taken on every syscall and fault from EL0
+ * and around preemption, dropped only when going back to EL0 or idling.
+ * it is held across context_switch() and handed to the next process.
+ */
+void kernel_lock(void);
+void kernel_unlock(void);
+
+#ifdef LOCK_STATS
+struct lock_stats;
+void kernel_lock_stats(struct lock_stats *out);
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include "atomic.h"
+
+/*
+ * ticket spinlock. a locker takes the next ticket with one atomic add and
+ * waits in wfe until owner reaches it, so CPUs get the lock in the order
+ * they asked. unlock is a release store of owner + 1, which also wakes
+ * the waiters. the _irqsave forms mask IRQs on this CPU first and must be
+ * used for locks that are also taken from interrupt handlers.
+ *
+ * build with -DLOCK_STATS (make LOCK_STATS=1) to count acquisitions,
+ * contended acquisitions and the counter cycles spent waiting.
+ */
+
+struct lock_stats {
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_cycles;       /* CNTPCT ticks */
+};
+
+#ifdef LOCK_STATS
+#define LOCK_STATS_FIELD        struct lock_stats stats;
+#else
+#define LOCK_STATS_FIELD
+#endif
+
+typedef struct {
+    union {
+        volatile uint32_t val;
+        struct {
+            volatile uint16_t owner;    /* ticket being served */
+            volatile uint16_t next;     /* next ticket handed out */
+        };
+    };
+    LOCK_STATS_FIELD
+} spinlock_t;
+
+#define SPINLOCK_INIT   { .val = 0 }
+
+/* out of line waiting, lock.c */
+void spin_lock_wait(spinlock_t *l, uint16_t ticket);
+void lock_stats_read(const struct lock_stats *src, struct lock_stats *out);
+
+static inline void spin_lock(spinlock_t *l)
+{
+    uint32_t old = atomic_fetch_add_acquire(&l->val, 1U << 16);
+    uint16_t ticket = old >> 16;
+    if ((uint16_t)old != ticket) {
+        spin_lock_wait(l, ticket);
+    }
+#ifdef LOCK_STATS
+    l->stats.acquired++;
+#endif
+}
+
+static inline int spin_trylock(spinlock_t *l)
+{
+    uint32_t old = l->val;
+    if ((uint16_t)old != (uint16_t)(old >> 16)) {
+        return 0;
+    }
+    if (atomic_cmpxchg_acquire(&l->val, old, old + (1U << 16)) != old) {
+        return 0;
+    }
+#ifdef LOCK_STATS
+    l->stats.acquired++;
+#endif
+    return 1;
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+    store_release16(&l->owner, l->owner + 1);
+}
+
+static inline int spin_is_locked(spinlock_t *l)
+{
+    uint32_t v = l->val;
+    return (uint16_t)v != (uint16_t)(v >> 16);
+}
+
+static inline unsigned long local_irq_save(void)
+{
+    unsigned long flags;
+    __asm__ volatile("mrs %0, daif\n msr daifset, #2" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void local_irq_restore(unsigned long flags)
+{
+    __asm__ volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+#define spin_lock_irqsave(l, flags) \
+    do { (flags) = local_irq_save(); spin_lock(l); } while (0)
+
+#define spin_unlock_irqrestore(l, flags) \
+    do { spin_unlock(l); local_irq_restore(flags); } while (0)
+
+#endif
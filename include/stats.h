@@ -0,0 +1,17 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+/*
+ * kernel counters rendered as text, for MSG_STATS. the shells only print
+ * the result, the EL0 one has no way to format numbers itself.
+ */
+
+#define STATS_MEM       0       /* heap, tags, call sites, pages, pools, TLB */
+#define STATS_SCHED     1       /* per CPU idle, balancing and FP switching, kernel lock */
+
+/* report which into buf, cut off at size - 1 and terminated. returns the length */
+size_t stats_report(int which, char *buf, size_t size);
+
+#endif
@@ -1,7 +1,24 @@
 #ifndef TIMER_H
 #define TIMER_H
 
+#include <stdint.h>
+
+/* slice length unit, one slice is SCHED_SLICE_TICKS of these */
+#define TIMER_HZ    100
+#define TIMER_IRQ   30          /* EL1 physical timer PPI */
+
+/*
+ * one-shot timer on CNTP_CVAL_EL0. there is no periodic tick, the
+ * scheduler programs the next deadline it cares about or stops the
+ * timer when it has none.
+ */
 void timer_init(void);
+void timer_init_cpu(void);               /* secondary CPUs */
 void timer_handler(void);
 
+uint64_t timer_now(void);               /* CNTPCT_EL0 */
+uint64_t timer_tick_cycles(void);       /* counter cycles per TIMER_HZ tick */
+void timer_set_deadline(uint64_t cval); /* fire once the counter reaches cval */
+void timer_stop(void);
+
 #endif 
\ No newline at end of file
@@ -1,13 +1,30 @@
 #ifndef UART_H
 #define UART_H
 
+#include <stddef.h>
+
 #define UART_IBRD   (UART_BASE + 0x24)
 #define UART_FBRD   (UART_BASE + 0x28)
 
+/* PL011 interrupt ID at the GIC */
+#ifdef RPI4_BUILD
+#define UART_IRQ    153     /* SPI 121 */
+#else
+#define UART_IRQ    33      /* SPI 1 on QEMU virt */
+#endif
+
 void uart_init(void);
 void uart_putc(char c);
 void uart_puts(const char *s);
 void uart_hex(unsigned long n);
-char uart_getc(void);
+size_t uart_write(const char *buf, size_t len);     /* raw bytes, never waits */
+void uart_flush(void);
+char uart_getc(void);          /* polls, for the kernel shell */
+
+/* interrupt driven transmit and receive, on once the GIC is up */
+void uart_enable_irq(void);
+void uart_irq(void);
+int uart_try_getc(void);        /* -1 when nothing has arrived */
+char uart_getc_sleep(void);     /* blocks the caller, kernel lock held */
 
 #endif
@@ -74,6 +74,12 @@ struct filesystem_type {
     int (*unlink)(const char *path);
     int (*mkdir)(const char *path);
     int (*remove_recursive)(const char *path);
+    /* kernel address of a file's data, contiguous and page aligned, for mmap.
+       a successful map counts as one mapping, map_get adds one for a copy
+       (fork) and map_put drops one */
+    int (*map)(const char *path, void **data, size_t *size);
+    void (*map_get)(void *data);
+    void (*map_put)(void *data);
 };
 
 
@@ -93,6 +99,10 @@ static struct mount* find_mount(const char *path);
 int resolve_path(const char *path, char *resolved);
 
 
+struct vfs_file *vfs_file_alloc(void);
+void vfs_file_free(struct vfs_file *file);
+
+
 int vfs_create(const char *path);  
 int vfs_close(int fd);
 int vfs_unlink(const char *path);
@@ -102,6 +112,9 @@ int vfs_mkdir(const char *path);
 
 
 int vfs_remove_recursive(const char *path);
+int vfs_map(const char *path, void **data, size_t *size);
+void vfs_map_get(void *data);
+void vfs_map_put(void *data);
 int vfs_read_dir(const char* path, struct dirent* dirents, int max_entries);
 void vfs_normalize_path(char* path);
 
@@ -0,0 +1,51 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+#include "mmu.h"
+
+/*
+ * user virtual memory areas. every mapping a process may touch is
+ * described by a vma, pages behind anonymous ones are allocated zeroed on
+ * the first fault. the list hangs off struct mm, sorted by address.
+ */
+
+#define VMA_ANON        (1 << 0)    /* demand-zero */
+#define VMA_GROWSDOWN   (1 << 1)    /* stack, extends on faults just below it */
+#define VMA_HEAP        (1 << 2)    /* moved by MSG_BRK */
+#define VMA_SHM         (1 << 3)    /* shared memory object, see shm.h */
+#define VMA_FILE        (1 << 4)    /* file data, obj is its kernel address */
+
+#define MAP_PRIVATE     0x04        /* Message.flags for MSG_MMAP, else shared read-only */
+
+/* stacks grow down to USER_STACK_TOP - USER_STACK_MAX, and never closer
+   than USER_STACK_GUARD to the mapping below */
+#define USER_STACK_MAX      0x800000UL
+#define USER_STACK_GUARD    0x10000UL
+
+/* shared and file mappings are placed top-down from here */
+#define USER_MMAP_TOP       (USER_STACK_TOP - USER_STACK_MAX - USER_STACK_GUARD)
+
+#define FAULT_WRITE     (1 << 0)
+#define FAULT_EXEC      (1 << 1)
+
+struct vma {
+    uint64_t start;
+    uint64_t end;           /* exclusive */
+    uint64_t prot;          /* PROT_USER_* */
+    int flags;
+    void *obj;              /* backing object (VMA_SHM, VMA_FILE) */
+    struct vma *next;
+};
+
+int vma_add(struct mm *mm, uint64_t start, uint64_t end, uint64_t prot, int flags);
+struct vma *vma_find(struct mm *mm, uint64_t addr);
+uint64_t vma_find_free(struct mm *mm, uint64_t size);
+void vma_unmap(struct mm *mm, struct vma *v);
+int vma_fault(struct mm *mm, uint64_t addr, int access);
+int vma_copy(struct mm *dst, struct mm *src);
+void vma_free_all(struct mm *mm);
+uint64_t vma_brk(struct mm *mm, uint64_t new_brk);
+uint64_t vma_map_file(struct mm *mm, void *data, size_t size, int flags);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H
+
+#include <stddef.h>
+
+struct process;
+
+/*
+ * processes sleeping until an event, in FIFO order. a sleeper checks its
+ * condition again after every wakeup, wakeups may be spurious. sleeping
+ * and waking both happen under the kernel lock, so a wakeup cannot slip
+ * in between the check and the sleep. interrupt handlers take the lock
+ * around the wakeup, they never run on a CPU that already holds it.
+ */
+struct wait_queue {
+    struct process *head;
+    struct process *tail;
+};
+
+#define WAIT_QUEUE_INIT     { NULL, NULL }
+
+void sleep_on(struct wait_queue *wq);       /* PROC_BLOCKED until woken */
+int wake_up_one(struct wait_queue *wq);     /* returns how many were woken */
+int wake_up_all(struct wait_queue *wq);
+
+#define wait_event(wq, cond)                \
+    do {                                    \
+        while (!(cond)) {                   \
+            sleep_on(wq);                   \
+        }                                   \
+    } while (0)
+
+#endif
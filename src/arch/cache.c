@@ -0,0 +1,198 @@
+#include "cache.h"
+#include "page_alloc.h"
+#include "uart.h"
+
+/* CTR_EL0 fields */
+#define CTR_IMINLINE(c)     ((c) & 0xf)             /* log2 words */
+#define CTR_L1IP(c)         (((c) >> 14) & 3)
+#define CTR_DMINLINE(c)     (((c) >> 16) & 0xf)
+#define CTR_IDC             (1UL << 28)             /* no D clean needed for I/D coherence */
+#define CTR_DIC             (1UL << 29)             /* no I invalidate needed */
+#define L1IP_PIPT           3
+
+#define SCTLR_C             (1UL << 2)
+#define SCTLR_I             (1UL << 12)
+
+#define BENCH_ORDER         5                       /* 128 KiB, two 64 KiB halves */
+#define BENCH_ROUNDS        16
+
+static uint64_t ctr;
+static size_t dline = 64;
+static size_t iline = 64;
+
+static inline uint64_t read_cntpct(void) {
+    uint64_t v;
+    __asm__ volatile("isb\n mrs %0, cntpct_el0" : "=r"(v));
+    return v;
+}
+
+static inline uint64_t read_cntfrq(void) {
+    uint64_t v;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(v));
+    return v;
+}
+
+static inline uint64_t read_sctlr(void) {
+    uint64_t v;
+    __asm__ volatile("mrs %0, sctlr_el1" : "=r"(v));
+    return v;
+}
+
+void cache_init(void) {
+    __asm__ volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    dline = 4UL << CTR_DMINLINE(ctr);
+    iline = 4UL << CTR_IMINLINE(ctr);
+}
+
+int cache_enabled(void) {
+    return (read_sctlr() & (SCTLR_C | SCTLR_I)) == (SCTLR_C | SCTLR_I);
+}
+
+void cache_enable(void) {
+    if (cache_enabled()) {
+        return;
+    }
+    // nothing was allocated with C clear, whatever sits in the lines is junk from reset
+    dcache_inval_all();
+    icache_inval_all();
+
+    uint64_t v = read_sctlr() | SCTLR_C | SCTLR_I;
+    __asm__ volatile("dsb sy\n msr sctlr_el1, %0\n isb" :: "r"(v) : "memory");
+}
+
+/* by-VA loops, the dsb makes the maintenance complete before we return */
+#define DCACHE_RANGE(op, start, size) do {                              \
+    uint64_t a = (uint64_t)(start) & ~(dline - 1);                      \
+    uint64_t e = (uint64_t)(start) + (size);                            \
+    for (; a < e; a += dline) {                                         \
+        __asm__ volatile("dc " op ", %0" :: "r"(a) : "memory");         \
+    }                                                                   \
+    __asm__ volatile("dsb sy" ::: "memory");                            \
+} while (0)
+
+void dcache_clean_range(const void *start, size_t size) {
+    DCACHE_RANGE("cvac", start, size);
+}
+
+void dcache_inval_range(const void *start, size_t size) {
+    DCACHE_RANGE("ivac", start, size);
+}
+
+void dcache_flush_range(const void *start, size_t size) {
+    DCACHE_RANGE("civac", start, size);
+}
+
+void icache_inval_all(void) {
+    __asm__ volatile("ic ialluis\n dsb ish\n isb" ::: "memory");
+}
+
+void icache_sync_range(const void *start, size_t size) {
+    if (!(ctr & CTR_IDC)) {
+        uint64_t a = (uint64_t)start & ~(dline - 1);
+        for (; a < (uint64_t)start + size; a += dline) {
+            __asm__ volatile("dc cvau, %0" :: "r"(a) : "memory");
+        }
+    }
+    __asm__ volatile("dsb ish" ::: "memory");
+    if (ctr & CTR_DIC) {
+        __asm__ volatile("isb");
+        return;
+    }
+
+    // only a PIPT I-cache is sure to drop the lines of other aliases of the page
+    if (CTR_L1IP(ctr) != L1IP_PIPT) {
+        icache_inval_all();
+        return;
+    }
+    uint64_t a = (uint64_t)start & ~(iline - 1);
+    for (; a < (uint64_t)start + size; a += iline) {
+        __asm__ volatile("ic ivau, %0" :: "r"(a) : "memory");
+    }
+    __asm__ volatile("dsb ish\n isb" ::: "memory");
+}
+
+/* every data or unified level up to LoC, clean writes dirty lines back first */
+static void dcache_all(int clean) {
+    uint64_t clidr, mmfr2;
+    __asm__ volatile("mrs %0, clidr_el1" : "=r"(clidr));
+    __asm__ volatile("mrs %0, id_aa64mmfr2_el1" : "=r"(mmfr2));
+    int ccidx = ((mmfr2 >> 20) & 0xf) != 0;
+    int loc = (clidr >> 24) & 7;
+
+    __asm__ volatile("dsb sy" ::: "memory");
+    for (int level = 0; level < loc; level++) {
+        int ctype = (clidr >> (3 * level)) & 7;
+        if (ctype < 2) {
+            continue;       /* no cache or I-cache only */
+        }
+
+        uint64_t ccsidr;
+        __asm__ volatile("msr csselr_el1, %0\n isb" :: "r"((uint64_t)level << 1));
+        __asm__ volatile("mrs %0, ccsidr_el1" : "=r"(ccsidr));
+
+        int line_shift = (ccsidr & 7) + 4;
+        uint64_t ways, sets;
+        if (ccidx) {
+            ways = ((ccsidr >> 3) & 0x1fffff) + 1;
+            sets = ((ccsidr >> 32) & 0xffffff) + 1;
+        } else {
+            ways = ((ccsidr >> 3) & 0x3ff) + 1;
+            sets = ((ccsidr >> 13) & 0x7fff) + 1;
+        }
+        int way_shift = ways > 1 ? __builtin_clz((uint32_t)(ways - 1)) : 0;
+
+        for (uint64_t w = 0; w < ways; w++) {
+            for (uint64_t s = 0; s < sets; s++) {
+                uint64_t sw = (w << way_shift) | (s << line_shift) | ((uint64_t)level << 1);
+                if (clean) {
+                    __asm__ volatile("dc cisw, %0" :: "r"(sw) : "memory");
+                } else {
+                    __asm__ volatile("dc isw, %0" :: "r"(sw) : "memory");
+                }
+            }
+        }
+    }
+    __asm__ volatile("msr csselr_el1, xzr\n dsb sy\n isb" ::: "memory");
+}
+
+void dcache_inval_all(void) {
+    dcache_all(0);
+}
+
+void dcache_flush_all(void) {
+    dcache_all(1);
+}
+
+/* 64 bit word copy, volatile so the compiler cannot turn it into a memcpy call */
+static void bench_copy(volatile uint64_t *dst, const volatile uint64_t *src, size_t words) {
+    for (size_t i = 0; i < words; i++) {
+        dst[i] = src[i];
+    }
+}
+
+uint64_t cache_bench(void) {
+    uint64_t *buf = page_alloc(BENCH_ORDER);
+    if (!buf) {
+        uart_puts("cache: no memory for benchmark\n");
+        return 0;
+    }
+    size_t half = (PAGE_SIZE << BENCH_ORDER) / 2;
+    size_t words = half / sizeof(uint64_t);
+    for (size_t i = 0; i < words; i++) {
+        buf[i] = i;
+    }
+
+    uint64_t start = read_cntpct();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        bench_copy(buf + words, buf, words);
+    }
+    uint64_t ticks = read_cntpct() - start;
+    page_free(buf);
+
+    if (!ticks) {
+        return 0;
+    }
+    // bytes read plus bytes written
+    uint64_t bytes = 2 * half * BENCH_ROUNDS;
+    return (bytes * read_cntfrq() / ticks) >> 20;
+}
@@ -4,6 +4,13 @@
 #include "uart.h"
 #include "exceptions.h"
 #include "message.h"
+#include "scratch.h"
+#include "process.h"
+#include "memlayout.h"
+#include "vma.h"
+#include "fpsimd.h"
+#include "klog.h"
+#include "kprintf.h"
 
 typedef unsigned long uint64_t;
 
@@ -19,7 +26,16 @@ static uint64_t saved_x0, saved_x1, saved_x2, saved_x8;
 // returns: 
 // - for syscalls: bits 63:32 = 0, bits 31:0 = syscall return value
 // - for exceptions: bits 63:32 = 1, bits 31:0 = unused (halt)
-uint64_t handle_sync_exception(uint64_t user_x0, uint64_t user_x1, uint64_t user_x2, uint64_t user_x8) {
+// - for faults fixed up (COW): bits 63:32 = 2, registers left untouched
+#define EXC_HALT    0x100000000ULL
+#define EXC_RESUME  0x200000000ULL
+
+// data abort ISS
+#define ESR_WNR             (1UL << 6)
+#define ESR_DFSC_PERM(esr)  (((esr) & 0x3c) == 0x0c)   // permission fault, any level
+#define ESR_DFSC_TRANS(esr) (((esr) & 0x3c) == 0x04)   // translation fault, any level
+static uint64_t do_sync_exception(uint64_t user_x0, uint64_t user_x1, uint64_t user_x2, uint64_t user_x8,
+                                  int from_user) {
     uint64_t esr, far, elr;
     asm volatile("mrs %0, esr_el1" : "=r"(esr));
     asm volatile("mrs %0, far_el1" : "=r"(far));
@@ -35,6 +51,36 @@ uint64_t handle_sync_exception(uint64_t user_x0, uint64_t user_x1, uint64_t user
         exception_count++;
     }
     
+    // write to a copy-on-write page, from EL0 or from the kernel touching user memory
+    if ((ec == 0x24 || ec == 0x25) && ESR_DFSC_PERM(esr) && (esr & ESR_WNR) &&
+        far >= USER_BASE && far < USER_END) {
+        struct process *p = get_current_process();
+        if (p && mmu_handle_cow(&p->mm, far) == 0) {
+            return EXC_RESUME;
+        }
+    }
+
+    // first touch of a demand-zero page (data from EL0 or EL1, or an EL0 fetch)
+    if ((ec == 0x24 || ec == 0x25 || ec == 0x20) && ESR_DFSC_TRANS(esr) &&
+        far >= USER_BASE && far < USER_END) {
+        struct process *p = get_current_process();
+        int access = 0;
+        if (ec == 0x20) {
+            access = FAULT_EXEC;
+        } else if (esr & ESR_WNR) {
+            access = FAULT_WRITE;
+        }
+        if (p && vma_fault(&p->mm, far, access) == 0) {
+            return EXC_RESUME;
+        }
+    }
+
+    // first FP/SIMD use since the process was switched in. the kernel is
+    // built without FP, so the same trap from EL1 is a bug and stays fatal
+    if (ec == 0x07 && from_user && fpsimd_trap() == 0) {
+        return EXC_RESUME;
+    }
+
     // check if its syscall (SVC instruction from EL0)
     if (ec == 0x15) {  // SVC instruction
         // uart_puts("SYSCALL DETECTED!\n");
@@ -120,6 +166,11 @@ uint64_t handle_sync_exception(uint64_t user_x0, uint64_t user_x1, uint64_t user
                 {
                     // x0 contains pointer to message structure
                     struct Message *user_msg = (struct Message*)saved_x0;
+                    // the kernel trusts buffers named by a message outside
+                    // the user window, see user_buffer_ok() in message.c
+                    if (saved_x0 < USER_BASE || saved_x0 > USER_END - sizeof(struct Message)) {
+                        return (uint64_t)-1;
+                    }
                     //uart_puts("DEBUG: SYS_SEND_MESSAGE called with ptr=");
                     //uart_hex((uint64_t)user_msg);
                     //uart_puts("\n");
@@ -139,9 +190,7 @@ uint64_t handle_sync_exception(uint64_t user_x0, uint64_t user_x1, uint64_t user
                 }
                 
             default:
-                uart_puts("Unknown syscall: ");
-                uart_hex(saved_x8);
-                uart_puts("\n");
+                kprintf("Unknown syscall: %lu\n", saved_x8);
                 return (uint64_t)-1;  
         }
         
@@ -153,10 +202,8 @@ uint64_t handle_sync_exception(uint64_t user_x0, uint64_t user_x1, uint64_t user
     
     // not a syscall so handle as error
     uart_puts("\n*** SYNC EXCEPTION CAUGHT! ***\n");
-    uart_puts("ESR_EL1: "); uart_hex(esr); uart_puts("\n");
-    uart_puts("EC: "); uart_hex(ec); uart_puts("\n");
-    uart_puts("ELR_EL1: "); uart_hex(elr); uart_puts("\n");
-    uart_puts("FAR_EL1: "); uart_hex(far); uart_puts("\n");
+    kprintf("ESR_EL1: %p\nEC: %lx\nELR_EL1: %p\nFAR_EL1: %p\n",
+            (void *)esr, ec, (void *)elr, (void *)far);
     
     // decode exception class (EC is bits 31:26 of ESR_EL1)
     switch(ec) {
@@ -181,18 +228,61 @@ uint64_t handle_sync_exception(uint64_t user_x0, uint64_t user_x1, uint64_t user
         case 0x21:  // Data Abort from same EL
             uart_puts("Exception: Data Abort from same EL\n");
             break;
+        case 0x24:
+            uart_puts("Exception: Data Abort from lower EL (not a COW fault)\n");
+            break;
+        case 0x25:
+            uart_puts("Exception: Data Abort from EL1 (not a COW fault)\n");
+            break;
         case 0x22:  // PC alignment fault
             uart_puts("Exception: PC alignment fault\n");
             break;
         default:
-            uart_puts("Exception: Unknown class ");
-            uart_hex(ec);
-            uart_puts("\n");
+            kprintf("Exception: Unknown class %lx\n", ec);
             break;
     }
     
     uart_puts("System halted due to unhandled exception.\n");
-    return 0x100000000ULL;  // Halt bits 63:32 = 1
+    klog_flush();
+    return EXC_HALT;  // Halt bits 63:32 = 1
+}
+
+// scratch buffers taken while handling the exception are dropped on return,
+// a process whose slice ran out gives up the CPU on its way back to EL0.
+// the whole thing runs under the kernel lock. a fault from EL1 is a
+// syscall touching a COW or not yet populated user page, it already holds
+// the lock, which is not recursive
+uint64_t handle_sync_exception(uint64_t user_x0, uint64_t user_x1, uint64_t user_x2, uint64_t user_x8,
+                               struct trap_frame *tf) {
+    int from_user = TF_FROM_USER(tf);
+    if (from_user) {
+        kernel_lock();
+    }
+    // the mark lives on this task's stack and knows its arena, the task
+    // may come back on another CPU
+    size_t mark = scratch_mark();
+    struct process *p = get_current_process();
+    if (from_user && p) {
+        p->scratch_mark = mark;
+    }
+    uint64_t ret = do_sync_exception(user_x0, user_x1, user_x2, user_x8, from_user);
+    scratch_release(mark);
+    if (!from_user) {
+        return ret;
+    }
+    if (p) {
+        p->scratch_mark = SCRATCH_NO_MARK;
+    }
+    if (!(ret & EXC_HALT) && sched_need_resched()) {
+        // the result goes into the frame now, we may come back much later
+        if (!(ret & EXC_RESUME)) {
+            tf->x[0] = ret;
+            ret = EXC_RESUME;
+        }
+        schedule();
+    }
+    kernel_unlock();
+    return ret;
 }
 
 #endif 
\ No newline at end of file
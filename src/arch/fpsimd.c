@@ -0,0 +1,113 @@
+#include "fpsimd.h"
+#include "process.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "smp.h"
+
+#define CPACR_FPEN_MASK     (3UL << 20)
+#define CPACR_FPEN_EL0_TRAP (1UL << 20)     /* EL1 may, EL0 traps */
+#define CPACR_FPEN_NONE     (3UL << 20)     /* nobody traps */
+
+/* whose state each CPU's registers were last loaded with */
+static struct process *fpsimd_owner[NR_CPUS];
+static struct fpsimd_stats fpsimd_stats[NR_CPUS];
+
+static inline uint64_t read_cpacr(void) {
+    uint64_t v;
+    __asm__ volatile("mrs %0, cpacr_el1" : "=r"(v));
+    return v;
+}
+
+static void set_fpen(uint64_t fpen) {
+    uint64_t v = read_cpacr();
+    if ((v & CPACR_FPEN_MASK) == fpen) {
+        return;
+    }
+    v = (v & ~CPACR_FPEN_MASK) | fpen;
+    __asm__ volatile("msr cpacr_el1, %0\n isb" :: "r"(v) : "memory");
+}
+
+// the running process has used FP since it was switched in
+static int fpsimd_live(void) {
+    return (read_cpacr() & CPACR_FPEN_MASK) == CPACR_FPEN_NONE;
+}
+
+void fpsimd_init_cpu(void) {
+    fpsimd_owner[smp_processor_id()] = NULL;
+    set_fpen(CPACR_FPEN_EL0_TRAP);
+}
+
+// from schedule(), before context_switch, kernel lock held
+void fpsimd_switch(struct process *prev, struct process *next) {
+    int cpu = smp_processor_id();
+
+    if (prev && prev->fpsimd && fpsimd_live()) {
+        fpsimd_save_state(prev->fpsimd);
+        fpsimd_stats[cpu].saves++;
+    }
+
+    // nobody else loaded anything here since next last ran on this CPU
+    if (next->fpsimd && fpsimd_owner[cpu] == next && next->fpsimd_cpu == cpu) {
+        set_fpen(CPACR_FPEN_NONE);
+        fpsimd_stats[cpu].reuses++;
+    } else {
+        set_fpen(CPACR_FPEN_EL0_TRAP);
+    }
+}
+
+int fpsimd_trap(void) {
+    struct process *p = current_process;
+    int cpu = smp_processor_id();
+    if (!p) {
+        return -1;
+    }
+    if (!p->fpsimd) {
+        p->fpsimd = kalloc_tag(sizeof(struct fpsimd_state), KMEM_PROCESS);
+        if (!p->fpsimd) {
+            return -1;
+        }
+        memset(p->fpsimd, 0, sizeof(struct fpsimd_state));
+        fpsimd_stats[cpu].first_uses++;
+    }
+
+    set_fpen(CPACR_FPEN_NONE);
+    fpsimd_load_state(p->fpsimd);
+    fpsimd_owner[cpu] = p;
+    p->fpsimd_cpu = cpu;
+    fpsimd_stats[cpu].restores++;
+    return 0;
+}
+
+// the child starts with the parent's registers as of the fork
+int fpsimd_fork(struct process *child, struct process *parent) {
+    child->fpsimd = NULL;
+    child->fpsimd_cpu = -1;
+    if (!parent->fpsimd) {
+        return 0;
+    }
+    if (parent == current_process && fpsimd_live()) {
+        fpsimd_save_state(parent->fpsimd);
+    }
+    child->fpsimd = kalloc_tag(sizeof(struct fpsimd_state), KMEM_PROCESS);
+    if (!child->fpsimd) {
+        return -1;
+    }
+    memcpy(child->fpsimd, parent->fpsimd, sizeof(struct fpsimd_state));
+    return 0;
+}
+
+void fpsimd_release(struct process *p) {
+    for (int i = 0; i < NR_CPUS; i++) {
+        if (fpsimd_owner[i] == p) {
+            fpsimd_owner[i] = NULL;
+        }
+    }
+    if (p->fpsimd) {
+        kfree(p->fpsimd);
+        p->fpsimd = NULL;
+    }
+}
+
+void fpsimd_cpu_stats(int cpu, struct fpsimd_stats *out) {
+    *out = fpsimd_stats[cpu];
+}
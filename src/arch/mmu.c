@@ -1,38 +1,104 @@
 #include <stdint.h>
 #include "uart.h"
+#include "memlayout.h"
+#include "page_alloc.h"
+#include "string.h"
+#include "mmu.h"
+#include "cache.h"
+#include "smp.h"
+#include "kprintf.h"
 
 /* AttrIdx0 = normal WB/WA, AttrIdx1 = device-nGnRnE */
 #define MAIR_VALUE  ((0xFFULL << 0) | (0x04ULL << 8))
 
-#define AF           (1ULL << 10)
-#define UXN          (1ULL << 54)
-#define AP_RW_EL0    (1ULL << 6)          /* AP[1:0]=0b01 */
-#define AP_RW_EL1    (0ULL << 6)          /* AP[1:0]=0b00 */
-#define BLOCK        (0ULL << 1)
-#define VALID        (1ULL << 0)
-#define ATTRIDX(n)  ((uint64_t)(n) << 2)
+/* TCR_EL1: 48 bit walks in both halves, 4 KiB granules, WB/WA inner shareable walks */
+#define TCR_T0SZ(n)     ((uint64_t)(64 - (n)) << 0)
+#define TCR_IRGN0_WBWA  (1ULL << 8)
+#define TCR_ORGN0_WBWA  (1ULL << 10)
+#define TCR_SH0_INNER   (3ULL << 12)
+#define TCR_TG0_4K      (0ULL << 14)
+#define TCR_T1SZ(n)     ((uint64_t)(64 - (n)) << 16)
+#define TCR_IRGN1_WBWA  (1ULL << 24)
+#define TCR_ORGN1_WBWA  (1ULL << 26)
+#define TCR_SH1_INNER   (3ULL << 28)
+#define TCR_TG1_4K      (2ULL << 30)
+#define TCR_IPS(n)      ((uint64_t)(n) << 32)
+#define TCR_AS          (1ULL << 36)        /* 16 bit ASIDs */
 
-#define L1_DESC(pa_gib, attridx, extra) \
-        (((uint64_t)(pa_gib) << 30) | AF | ATTRIDX(attridx) | (extra) | \
-         BLOCK | VALID)
+#define VA_BITS     48
 
-/* one 4 KiB aligned level1 table */
-__attribute__((aligned(4096))) static uint64_t l1[512];
+/*
+ * kernel_pgd sits in TTBR1 for good and maps RAM and devices at
+ * KERNEL_VBASE + physical with global entries, so kernel TLB entries
+ * survive every switch. TTBR0 only ever holds a process's own tables,
+ * or empty_pgd while no process address space is active.
+ */
+__attribute__((aligned(4096))) static pte_t kernel_pgd[PT_ENTRIES];
+__attribute__((aligned(4096))) static pte_t kernel_l1[PT_ENTRIES];
+__attribute__((aligned(4096))) static pte_t empty_pgd[PT_ENTRIES];
+
+static struct mm kernel_mm = { .pgd = kernel_pgd, .asid = 0 };
+
+/*
+ * ASID allocator. an mm keeps its ASID for as long as the generation it
+ * was handed out in is current, so switching between processes never
+ * needs a flush. when the space runs out the generation is bumped, the
+ * TLB flushed once, and everybody picks up a fresh ASID on next switch.
+ * the mms running on other CPUs keep their numbers across a rollover.
+ * ASID 0 is the kernel's. callers hold the kernel lock.
+ */
+#define MAX_ASIDS       (1UL << ASID_SHIFT)
+static unsigned int asid_bits = 8;
+static uint64_t asid_generation = 1ULL << ASID_SHIFT;
+static uint64_t asid_map[MAX_ASIDS / 64];
+static uint64_t next_asid = 1;
+static struct tlb_stats tlb_stats;
+static uint64_t tcr_value;          /* secondaries load the same */
 
 static inline void isb(void){ __asm__ volatile("isb"); }
 static inline void write_mair(uint64_t v){ __asm__ volatile("msr mair_el1,%0"::"r"(v)); }
 static inline void write_tcr (uint64_t v){ __asm__ volatile("msr tcr_el1,%0"::"r"(v)); }
-static inline void write_ttbr0(void *p)  { __asm__ volatile("msr ttbr0_el1,%0"::"r"(p)); }
-static inline void enable_mmu(void)
-{
-    __asm__ volatile(
-        "mrs  x0, sctlr_el1\n"
-        "orr  x0, x0, #1\n"            
-        "bic  x0, x0, #(1<<28)\n"      
-        "msr  sctlr_el1, x0");
-    isb();
+static inline void write_ttbr0(uint64_t pa){ __asm__ volatile("msr ttbr0_el1,%0"::"r"(pa)); }
+static inline void write_ttbr1(uint64_t pa){ __asm__ volatile("msr ttbr1_el1,%0"::"r"(pa)); }
+static inline void tlb_flush_all(void)
+{
+    __asm__ volatile("dsb ishst\n tlbi vmalle1is\n dsb ish\n isb" ::: "memory");
+    tlb_stats.full_flushes++;
+}
+static inline void tlb_flush_asid(uint64_t asid)
+{
+    __asm__ volatile("dsb ishst\n tlbi aside1is, %0\n dsb ish\n isb"
+                     :: "r"((asid & ASID_MASK) << 48) : "memory");
+    tlb_stats.asid_flushes++;
+}
+
+/* processes without an address space of their own may carry a copy of kernel_mm */
+static inline int is_kernel_mm(struct mm *mm)
+{
+    return mm->pgd == kernel_pgd;
+}
+
+static inline int asid_live(struct mm *mm)
+{
+    return mm->asid && (mm->asid & ~ASID_MASK) == asid_generation;
 }
 
+/* drop one page of mm from the TLB, global for the kernel, by ASID otherwise */
+static void tlb_flush_page(struct mm *mm, uint64_t va)
+{
+    if (is_kernel_mm(mm)) {
+        __asm__ volatile("dsb ishst\n tlbi vaae1is, %0\n dsb ish\n isb"
+                         :: "r"((va >> PAGE_SHIFT) & ((1ULL << 44) - 1)) : "memory");
+    } else if (asid_live(mm)) {
+        uint64_t arg = ((mm->asid & ASID_MASK) << 48) | ((va >> PAGE_SHIFT) & ((1ULL << 44) - 1));
+        __asm__ volatile("dsb ishst\n tlbi vae1is, %0\n dsb ish\n isb"
+                         :: "r"(arg) : "memory");
+    } else {
+        /* ASID from an old generation, the rollover flush already got it */
+        return;
+    }
+    tlb_stats.page_flushes++;
+}
 static inline uint64_t read_sctlr(void)
 {
     uint64_t v;
@@ -46,38 +112,415 @@ static inline void write_sctlr(uint64_t v)
     isb();
 }
 
+static pte_t *table_alloc(void)
+{
+    pte_t *t = page_alloc(0);
+    if (t) {
+        memset(t, 0, PAGE_SIZE);
+    }
+    return t;
+}
+
+static inline pte_t *entry_table(pte_t e)
+{
+    return phys_to_virt(e & PTE_ADDR_MASK);
+}
+
+static inline int is_table(pte_t e, int level)
+{
+    return level < 3 && (e & (PTE_VALID | PTE_TABLE)) == (PTE_VALID | PTE_TABLE);
+}
+
+/* map [va, va + size) to pa, using 1 GiB / 2 MiB blocks where alignment allows */
+int mmu_map(struct mm *mm, uint64_t va, uint64_t pa, size_t size, uint64_t prot)
+{
+    if ((va | pa | size) & (PAGE_SIZE - 1)) {
+        return -1;
+    }
+    prot &= ~(PTE_ADDR_MASK | PTE_VALID | PTE_TABLE);
+
+    while (size) {
+        pte_t *table = mm->pgd;
+        pte_t *e = NULL;
+        pte_t old = 0;
+        uint64_t step = PAGE_SIZE;
+
+        for (int level = 0; level <= 3; level++) {
+            e = &table[PT_INDEX(level, va)];
+            if (level == 3) {
+                old = *e;
+                *e = pa | prot | PTE_PAGE | PTE_VALID;
+                break;
+            }
+
+            uint64_t bsize = LEVEL_SIZE(level);
+            if (level > 0 && !((va | pa) & (bsize - 1)) && size >= bsize && !is_table(*e, level)) {
+                old = *e;
+                *e = pa | prot | PTE_VALID;
+                step = bsize;
+                break;
+            }
+
+            if (!(*e & PTE_VALID)) {
+                pte_t *next = table_alloc();
+                if (!next) {
+                    return -1;
+                }
+                *e = virt_to_phys(next) | PTE_TABLE | PTE_VALID;
+            } else if (!is_table(*e, level)) {
+                /* already covered by a bigger block */
+                return -1;
+            }
+            table = entry_table(*e);
+        }
+
+        /* invalid entries are never cached, only replacements need a flush */
+        if (old & PTE_VALID) {
+            tlb_flush_page(mm, va);
+        }
+        va += step;
+        pa += step;
+        size -= step;
+    }
+    return 0;
+}
+
+/* leaf entry (page or block) for va, NULL when nothing is mapped there */
+pte_t *mmu_walk(struct mm *mm, uint64_t va, int *level)
+{
+    pte_t *table = mm->pgd;
+    for (int l = 0; l <= 3; l++) {
+        pte_t *e = &table[PT_INDEX(l, va)];
+        if (!(*e & PTE_VALID)) {
+            return NULL;
+        }
+        if (!is_table(*e, l)) {
+            if (level) {
+                *level = l;
+            }
+            return e;
+        }
+        table = entry_table(*e);
+    }
+    return NULL;
+}
+
+uint64_t mmu_translate(struct mm *mm, uint64_t va)
+{
+    int level;
+    pte_t *e = mmu_walk(mm, va, &level);
+    if (!e) {
+        return ~0ULL;
+    }
+    uint64_t mask = LEVEL_SIZE(level) - 1;
+    return (*e & PTE_ADDR_MASK & ~mask) | (va & mask);
+}
+
+/* clears the mappings only, whoever mapped the frames still owns them */
+int mmu_unmap(struct mm *mm, uint64_t va, size_t size)
+{
+    if ((va | size) & (PAGE_SIZE - 1)) {
+        return -1;
+    }
+    while (size) {
+        int level;
+        pte_t *e = mmu_walk(mm, va, &level);
+        uint64_t step = PAGE_SIZE;
+        if (e) {
+            step = LEVEL_SIZE(level);
+            if ((va & (step - 1)) || size < step) {
+                /* would need to split a block */
+                return -1;
+            }
+            *e = 0;
+            tlb_flush_page(mm, va);
+        }
+        if (step > size) {
+            break;
+        }
+        va += step;
+        size -= step;
+    }
+    return 0;
+}
+
+struct mm *mmu_kernel_mm(void)
+{
+    return &kernel_mm;
+}
+
+/* the kernel lives in TTBR1, a new address space starts out empty */
+int mmu_new_address_space(struct mm *mm)
+{
+    pte_t *pgd = table_alloc();
+    if (!pgd) {
+        return -1;
+    }
+    mm->pgd = pgd;
+    mm->asid = 0;
+    mm->vmas = NULL;
+    mm->brk_start = mm->brk = 0;
+    mm->rss = 0;
+    return 0;
+}
+
+static inline struct page *frame_page(pte_t e)
+{
+    return virt_to_page(phys_to_virt(e & PTE_ADDR_MASK));
+}
+
+static int share_level(struct mm *dst, pte_t *table, int level, uint64_t va)
+{
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        uint64_t eva = va + ((uint64_t)i << LEVEL_SHIFT(level));
+        if (!(table[i] & PTE_VALID)) {
+            continue;
+        }
+        if (is_table(table[i], level)) {
+            if (share_level(dst, entry_table(table[i]), level + 1, eva) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* writable private pages turn read-only in both, the first write copies */
+        if (!(table[i] & (PTE_RDONLY | PTE_SHARED))) {
+            table[i] |= PTE_RDONLY | PTE_COW;
+        }
+        struct page *pg = frame_page(table[i]);
+        get_page(pg);
+        if (mmu_map(dst, eva, table[i] & PTE_ADDR_MASK, LEVEL_SIZE(level), table[i]) < 0) {
+            put_page(pg);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* dst maps the same frames as src, O(page tables) rather than O(memory) */
+int mmu_share_user(struct mm *dst, struct mm *src)
+{
+    int ret = share_level(dst, src->pgd, 0, 0);
+
+    /* src lost write permission on every shared page, one ASID flush covers it */
+    if (asid_live(src)) {
+        tlb_flush_asid(src->asid);
+    }
+    return ret;
+}
+
+/* write fault on a COW page: take it over if nobody else has it, copy otherwise */
+int mmu_handle_cow(struct mm *mm, uint64_t va)
+{
+    int level;
+    pte_t *e = mmu_walk(mm, va, &level);
+    if (!e || !(*e & PTE_COW)) {
+        return -1;
+    }
+
+    size_t size = LEVEL_SIZE(level);
+    uint64_t base = va & ~(size - 1);
+    struct page *pg = frame_page(*e);
+
+    // frames that are not a page block of their own (file data) are always copied
+    if (pg && (pg->flags & PG_HEAD) && pg->refcount == 1) {
+        *e &= ~(PTE_RDONLY | PTE_COW);
+        tlb_flush_page(mm, base);
+        return 0;
+    }
+
+    void *copy = page_alloc(get_order(size));
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, phys_to_virt(*e & PTE_ADDR_MASK), size);
+    if (!(*e & PTE_UXN)) {
+        icache_sync_range(copy, size);
+    }
+    if (mmu_map(mm, base, virt_to_phys(copy), size, *e & ~(PTE_RDONLY | PTE_COW)) < 0) {
+        page_free(copy);
+        return -1;
+    }
+    put_page(pg);
+    return 0;
+}
+
+/* frees user tables and drops a reference on the frames behind them */
+static void free_level(pte_t *table, int level)
+{
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        pte_t e = table[i];
+        if (!(e & PTE_VALID)) {
+            continue;
+        }
+        if (is_table(e, level)) {
+            free_level(entry_table(e), level + 1);
+            page_free(entry_table(e));
+        } else {
+            put_page(frame_page(e));
+        }
+    }
+}
+
+void mmu_free_address_space(struct mm *mm)
+{
+    if (!mm->pgd || is_kernel_mm(mm)) {
+        return;
+    }
+    free_level(mm->pgd, 0);
+    page_free(mm->pgd);
+    mm->pgd = NULL;
+
+    /* the ASID goes back to the pool, nothing tagged with it may survive */
+    if (asid_live(mm)) {
+        tlb_flush_asid(mm->asid);
+        asid_map[(mm->asid & ASID_MASK) / 64] &= ~(1ULL << ((mm->asid & ASID_MASK) % 64));
+    }
+    mm->asid = 0;
+    for (int i = 0; i < NR_CPUS; i++) {
+        if (cpus[i].active_mm == mm) {
+            cpus[i].active_mm = &kernel_mm;
+        }
+    }
+}
+
+static inline int asid_test_and_set(uint64_t asid)
+{
+    uint64_t bit = 1ULL << (asid % 64);
+    if (asid_map[asid / 64] & bit) {
+        return 1;
+    }
+    asid_map[asid / 64] |= bit;
+    return 0;
+}
+
+static uint64_t asid_new(void)
+{
+    uint64_t nr = 1ULL << asid_bits;
+    for (uint64_t a = next_asid; a < nr; a++) {
+        if (!asid_test_and_set(a)) {
+            next_asid = a + 1;
+            return asid_generation | a;
+        }
+    }
+    /* numbers freed by exited processes were flushed, they can go round again */
+    for (uint64_t a = 1; a < next_asid && a < nr; a++) {
+        if (!asid_test_and_set(a)) {
+            next_asid = a + 1;
+            return asid_generation | a;
+        }
+    }
+
+    /* out of ASIDs: new generation, one flush, the running mms keep their numbers */
+    asid_generation += 1ULL << ASID_SHIFT;
+    memset(asid_map, 0, sizeof(asid_map));
+    tlb_flush_all();
+    tlb_stats.rollovers++;
+    for (int i = 0; i < NR_CPUS; i++) {
+        struct mm *active = cpus[i].active_mm;
+        if (active && !is_kernel_mm(active) && active->asid) {
+            asid_test_and_set(active->asid & ASID_MASK);
+            active->asid = asid_generation | (active->asid & ASID_MASK);
+        }
+    }
+
+    for (uint64_t a = 1; a < nr; a++) {
+        if (!asid_test_and_set(a)) {
+            next_asid = a + 1;
+            return asid_generation | a;
+        }
+    }
+    return 0;   /* unreachable, there is always more than one ASID */
+}
+
+uint64_t mmu_activate(struct mm *mm)
+{
+    if (!mm || !mm->pgd) {
+        mm = &kernel_mm;
+    }
+    if (!is_kernel_mm(mm) && !asid_live(mm)) {
+        mm->asid = asid_new();
+    }
+    this_cpu()->active_mm = mm;
+    tlb_stats.switches++;
+    if (is_kernel_mm(mm)) {
+        return virt_to_phys(empty_pgd);
+    }
+    return virt_to_phys(mm->pgd) | ((mm->asid & ASID_MASK) << 48);
+}
+
+/* switching with a tagged TTBR0 leaves everybody else's TLB entries alone */
+void mmu_switch(struct mm *mm)
+{
+    uint64_t ttbr0 = mmu_activate(mm);
+    __asm__ volatile("dsb ishst");
+    write_ttbr0(ttbr0);
+    isb();
+}
+
+void mmu_tlb_stats(struct tlb_stats *out)
+{
+    *out = tlb_stats;
+}
+
 void mmu_init(void)
 {
     uart_puts("MMU init start\n");
 
-/* 0-1 GiB devices (UART) EL1 RW, UXN */
-//l1[0] = L1_DESC(0, 1, UXN | AP_RW_EL1);
-l1[0] = L1_DESC(0,      /* physical GiB */
-                1,      /* AttrIdx1 = device */
-                UXN | AP_RW_EL0);   // was AP_RW_EL1
+    memset(kernel_pgd, 0, sizeof(kernel_pgd));
+    memset(kernel_l1, 0, sizeof(kernel_l1));
+    memset(empty_pgd, 0, sizeof(empty_pgd));
+    kernel_pgd[0] = virt_to_phys(kernel_l1) | PTE_TABLE | PTE_VALID;
+
+/* 0-1 GiB devices (UART, GIC), EL1 only */
+mmu_map(&kernel_mm, KERNEL_VBASE, 0, 1UL << 30, PROT_DEVICE);
 
 /* 1-2 GiB kernel EL1 RW/X*/
-l1[1] = L1_DESC(1, 0, AP_RW_EL1);
+mmu_map(&kernel_mm, KERNEL_VBASE + RAM_BASE, RAM_BASE, 1UL << 30, PROT_KERNEL);
 
-/* 2-3 GiB user code+stack  EL0 RW/X (no UXN bit = user can execute)*/
-l1[2] = L1_DESC(2, 0, AP_RW_EL0);
+/* the rest of RAM belongs to page_alloc, EL1 RW only. user pages are
+   reached through here too, the user window itself is only in TTBR0 */
+for (uint64_t gib = (RAM_BASE >> 30) + 1; gib < (page_alloc_ram_end() + (1UL << 30) - 1) >> 30; gib++) {
+    mmu_map(&kernel_mm, KERNEL_VBASE + (gib << 30), gib << 30, 1UL << 30, PROT_KERNEL | PTE_PXN);
+}
 
 // debug...
-uart_puts("MMU L1 Block 0: "); uart_hex(l1[0]); uart_puts("\n");
-uart_puts("MMU L1 Block 1: "); uart_hex(l1[1]); uart_puts("\n");
-uart_puts("MMU L1 Block 2: "); uart_hex(l1[2]); uart_puts("\n");
+kprintf("MMU L1 Block 0: %p\nMMU L1 Block 1: %p\nMMU L1 Block 2: %p\n",
+        (void *)kernel_l1[0], (void *)kernel_l1[1], (void *)kernel_l1[2]);
 
 
-    uart_puts("L1 identity blocks set\n");
+    uart_puts("L1 kernel blocks set\n");
 
     write_mair(MAIR_VALUE);                 uart_puts("MAIR set\n");
 
-    write_tcr(0x00000000808519ULL);         uart_puts("TCR set\n");
+    uint64_t mmfr0;
+    __asm__ volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    uint64_t tcr = TCR_T0SZ(VA_BITS) | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA |
+                   TCR_SH0_INNER | TCR_TG0_4K |
+                   TCR_T1SZ(VA_BITS) | TCR_IRGN1_WBWA | TCR_ORGN1_WBWA |
+                   TCR_SH1_INNER | TCR_TG1_4K | TCR_IPS(mmfr0 & 0xf);
+    if (((mmfr0 >> 4) & 0xf) == 2) {
+        asid_bits = 16;
+        tcr |= TCR_AS;
+    }
+    write_tcr(tcr);                         uart_puts("TCR set\n");
+    tcr_value = tcr;
 
-    write_ttbr0(l1);                        uart_puts("TTBR0 set\n");
+    /* boot.S left its tables in both halves, ours map the kernel the same
+       way and the identity map goes away with TTBR0 */
+    write_ttbr1(virt_to_phys(kernel_pgd));  uart_puts("TTBR1 set\n");
+    write_ttbr0(virt_to_phys(empty_pgd));   uart_puts("TTBR0 emptied\n");
+    /* nothing of the identity map may outlive it, the first switch to a
+       process does no flush of its own */
+    tlb_flush_all();
+    this_cpu()->active_mm = &kernel_mm;
 
-    uart_puts("Enabling MMU...\n");
-    enable_mmu();                           uart_puts("MMU enabled\n");
+    /* caches were off so far, measure what turning them on buys */
+    cache_init();
+    uint64_t uncached = cache_bench();
+    cache_enable();                         uart_puts("Caches enabled\n");
+    uint64_t cached = cache_bench();
+    kprintf("copy MiB/s, caches off %lu, on %lu\n", uncached, cached);
 
     
     /* temporary */
@@ -89,4 +532,16 @@ uart_puts("MMU L1 Block 2: "); uart_hex(l1[2]); uart_puts("\n");
     isb();
 }
 
-uint64_t mmu_get_l1_block(int i){ return l1[i]; }
\ No newline at end of file
+/* a secondary CPU comes up on boot.S's tables, move it to the kernel's */
+void mmu_init_secondary(void)
+{
+    write_mair(MAIR_VALUE);
+    write_tcr(tcr_value);
+    write_ttbr1(virt_to_phys(kernel_pgd));
+    write_ttbr0(virt_to_phys(empty_pgd));
+    isb();
+    __asm__ volatile("dsb nshst\n tlbi vmalle1\n dsb nsh\n isb" ::: "memory");
+    this_cpu()->active_mm = &kernel_mm;
+}
+
+uint64_t mmu_get_l1_block(int i){ return kernel_l1[i]; }
@@ -1,12 +1,16 @@
 #include "gic.h"
+#include "memlayout.h"
+#include "smp.h"
 
 
-#define GICD_BASE 0x08000000
-#define GICC_BASE 0x08010000
+#define GICD_BASE (KERNEL_VBASE + 0x08000000UL)
+#define GICC_BASE (KERNEL_VBASE + 0x08010000UL)
 
 #define GICD_CTLR        0x000
 #define GICD_ISENABLER   0x100
 #define GICD_ICENABLER   0x180
+#define GICD_ITARGETSR   0x800
+#define GICD_SGIR        0xF00
 
 #define GICC_CTLR        0x000
 #define GICC_PMR         0x004
@@ -21,21 +25,38 @@ static unsigned int mmio_read(unsigned long addr) {
     return *(volatile unsigned int *)addr;
 }
 
+/* GICv2 CPU interface mask of every CPU, the SGI target list wants these */
+static unsigned char cpu_if_mask[NR_CPUS];
+
 void gic_init(void) {
-    // disable GIC init for user shell in this version
-    // interrupts interfere with UART input
-    /*
     mmio_write(GICD_BASE + GICD_CTLR, 1);
     
+    gic_init_cpu();
+}
+
+// the CPU interface and the SGI/PPI enables are banked, every CPU does its own
+void gic_init_cpu(void) {
     mmio_write(GICC_BASE + GICC_CTLR, 1);
     
+    // let every priority through
     mmio_write(GICC_BASE + GICC_PMR, 0xFF);
-    
-    gic_enable_interrupt(30);
-    */
+
+    // the first ITARGETSR bytes read back as this CPU's own interface
+    cpu_if_mask[smp_processor_id()] = mmio_read(GICD_BASE + GICD_ITARGETSR) & 0xff;
+
+    gic_enable_interrupt(IPI_RESCHEDULE);
+}
+
+void gic_send_sgi(int cpu, unsigned int sgi) {
+    __asm__ volatile("dsb ishst" ::: "memory");
+    mmio_write(GICD_BASE + GICD_SGIR, ((unsigned int)cpu_if_mask[cpu] << 16) | (sgi & 0xf));
 }
 
+// SPIs are routed to the CPU that enables them
 void gic_enable_interrupt(int irq) {
+    if (irq >= 32) {
+        *(volatile unsigned char *)(GICD_BASE + GICD_ITARGETSR + irq) = cpu_if_mask[smp_processor_id()];
+    }
     unsigned int reg_offset = GICD_ISENABLER + ((irq / 32) * 4);
     unsigned int bit = 1U << (irq % 32);
     mmio_write(GICD_BASE + reg_offset, bit);
@@ -3,6 +3,8 @@
 #include "uart.h"
 #include "process.h"
 #include "gic.h"
+#include "memlayout.h"
+#include "kprintf.h"
 
 
 #define read_sysreg(reg) ({ \
@@ -19,10 +21,9 @@
 #define cnthctl_el2 S3_4_C14_C1_0
 
 
-#define TIMER_INTERVAL 62500000  
 
-#define GICD_BASE       0x08000000UL
-#define GICC_BASE       0x08010000UL
+#define GICD_BASE       (KERNEL_VBASE + 0x08000000UL)
+#define GICC_BASE       (KERNEL_VBASE + 0x08010000UL)
 #define GICD_CTLR       ((volatile uint32_t*)(GICD_BASE + 0x0))
 #define GICD_ISENABLER(n)   ((volatile uint32_t*)(GICD_BASE + 0x100 + 4 * (n)))
 #define GICD_ITARGETSR(n)   ((volatile uint8_t*)(GICD_BASE + 0x800 + (n)))
@@ -32,49 +33,58 @@
 #define GICC_IAR           ((volatile uint32_t*)(GICC_BASE + 0xC))
 #define GICC_EOIR          ((volatile uint32_t*)(GICC_BASE + 0x10))
 
+#define CNTP_CTL_ENABLE (1UL << 0)
+
+static uint64_t tick_cycles;
+
 void timer_init(void) {
-    uart_puts("Timer initialized (disabled for user shell testing)\n");
-    
-    // like GIC, disable timer init, for shell in this version
-    /*
     uint64_t cntfrq;
     asm volatile("mrs %0, cntfrq_el0" : "=r" (cntfrq));
     
-    uint64_t interval = cntfrq / 1000; 
-    
-    
-    asm volatile("msr cntp_tval_el0, %0" :: "r" (interval));
-    
-    
-    uint64_t cntp_ctl = 1; 
-    asm volatile("msr cntp_ctl_el0, %0" :: "r" (cntp_ctl));
-    
-    
-    gic_enable_interrupt(30);  
+    tick_cycles = cntfrq / TIMER_HZ;
     
+    timer_init_cpu();
+
+    kprintf("Timer initialized, tick %lu cycles\n", tick_cycles);
+}
+
+// every CPU has its own timer and its own enable for the PPI
+void timer_init_cpu(void) {
+    // off until the scheduler has a deadline
+    timer_stop();
     
-    asm volatile("msr daifclr, #2");
-    */
+    gic_enable_interrupt(TIMER_IRQ);  
+}
+
+uint64_t timer_now(void) {
+    uint64_t v;
+    asm volatile("isb\n mrs %0, cntpct_el0" : "=r" (v));
+    return v;
 }
 
+uint64_t timer_tick_cycles(void) {
+    return tick_cycles;
+}
+
+void timer_set_deadline(uint64_t cval) {
+    asm volatile("msr cntp_cval_el0, %0" :: "r" (cval));
+    asm volatile("msr cntp_ctl_el0, %0\n isb" :: "r" (CNTP_CTL_ENABLE));
+}
+
+// disabling also drops the interrupt line
+void timer_stop(void) {
+    asm volatile("msr cntp_ctl_el0, xzr\n isb");
+}
+
+// called from handle_irq, which acknowledges and ends the interrupt. the
+// condition stays asserted while cval is in the past, so the timer is
+// stopped first and sched_tick() arms it again if it still has a deadline
 void timer_handler(void) {
-    
-    unsigned int irq = gic_acknowledge_interrupt();
-    
-    
-    uint64_t cntfrq;
-    asm volatile("mrs %0, cntfrq_el0" : "=r" (cntfrq));
-    uint64_t interval = cntfrq / 1000;
-    asm volatile("msr cntp_tval_el0, %0" :: "r" (interval));
-    
-    // disable automatic scheduling during user shell
-    // schedule();
-    
-    
-    gic_end_interrupt(irq);
+    timer_stop();
+    sched_tick();
 }
 
 void enable_timer_interrupt(void) {
     
-    gic_enable_interrupt(30);  
+    gic_enable_interrupt(TIMER_IRQ);  
 } 
\ No newline at end of file
@@ -1,9 +1,14 @@
 #include "uart.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "waitqueue.h"
+#include "smp.h"
+#include "gic.h"
 
 #ifdef RPI4_BUILD
-#define UART_BASE 0xFE201000  
+#define UART_BASE (KERNEL_VBASE + 0xFE201000UL)
 #else
-#define UART_BASE 0x09000000  
+#define UART_BASE (KERNEL_VBASE + 0x09000000UL)
 #endif
 
 #define UART_DR     (UART_BASE + 0x00)
@@ -12,6 +17,16 @@
 #define UART_CR     (UART_BASE + 0x30)
 #define UART_IFLS   (UART_BASE + 0x34)
 #define UART_IMSC   (UART_BASE + 0x38)
+#define UART_MIS    (UART_BASE + 0x40)
+#define UART_ICR    (UART_BASE + 0x44)
+
+#define INT_RX      (1 << 4)    /* RX FIFO reached its trigger level */
+#define INT_TX      (1 << 5)    /* TX FIFO drained to its trigger level */
+#define INT_RT      (1 << 6)    /* RX FIFO not empty and the line went quiet */
+
+/* FIFO trigger levels: refill TX at 1/8 full, take RX at 1/2 full */
+#define IFLS_TX_1_8 (0 << 0)
+#define IFLS_RX_1_2 (2 << 3)
 
 #define FR_TXFF     (1 << 5)  
 #define FR_RXFE     (1 << 4)  
@@ -34,42 +49,203 @@ void uart_init(void)
     mmio_write(UART_IBRD, 26);     
     mmio_write(UART_FBRD, 3);      
     mmio_write(UART_LCRH, (1 << 4) | (1 << 5) | (1 << 6)); 
+    mmio_write(UART_IFLS, IFLS_TX_1_8 | IFLS_RX_1_2);
     
     
     mmio_write(UART_CR, (1 << 0) | (1 << 8) | (1 << 9));  
 }
 
+/*
+ * output is queued in tx_buf and moved into the TX FIFO a FIFO's worth at
+ * a time by the TX interrupt, which is only unmasked while there is
+ * something queued. writers block only when tx_buf is full, and then just
+ * for as long as it takes to make room. until the interrupt is on every
+ * write waits for its own bytes to reach the FIFO, as before.
+ */
+#define TX_BUF_SIZE 4096    /* power of two */
+
+static char tx_buf[TX_BUF_SIZE];
+static unsigned int tx_head, tx_tail;  /* free running, masked on use */
+static spinlock_t tx_lock = SPINLOCK_INIT;
+static int tx_irq_on;
+
+// tx_buf into the FIFO until one of them runs out, tx_lock held
+static void tx_fill(void) {
+    while (tx_head != tx_tail && !(mmio_read(UART_FR) & FR_TXFF)) {
+        mmio_write(UART_DR, tx_buf[tx_tail++ & (TX_BUF_SIZE - 1)]);
+    }
+}
+
+// queues one byte, pushing older ones out by hand while the buffer is full
+static void tx_put(char c) {
+    while (tx_head - tx_tail == TX_BUF_SIZE) {
+        tx_fill();
+    }
+    tx_buf[tx_head++ & (TX_BUF_SIZE - 1)] = c;
+}
+
+// after queueing: prime the FIFO and leave the rest to the interrupt
+static void tx_start(void) {
+    if (!tx_irq_on) {
+        while (tx_head != tx_tail) {
+            tx_fill();
+        }
+        return;
+    }
+    tx_fill();
+    if (tx_head != tx_tail) {
+        mmio_write(UART_IMSC, mmio_read(UART_IMSC) | INT_TX);
+    }
+}
+
+// queues what fits without waiting, returns how much that was
+size_t uart_write(const char *buf, size_t len) {
+    unsigned long flags;
+    size_t n = 0;
+    spin_lock_irqsave(&tx_lock, flags);
+    while (n < len && tx_head - tx_tail < TX_BUF_SIZE) {
+        tx_buf[tx_head++ & (TX_BUF_SIZE - 1)] = buf[n++];
+    }
+    tx_start();
+    spin_unlock_irqrestore(&tx_lock, flags);
+    return n;
+}
+
+// everything queued so far is on the wire, for a halting kernel
+void uart_flush(void) {
+    unsigned long flags;
+    spin_lock_irqsave(&tx_lock, flags);
+    while (tx_head != tx_tail) {
+        tx_fill();
+    }
+    while (mmio_read(UART_FR) & FR_BUSY) { }
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
 void uart_putc(char c) {
-    
-    while (mmio_read(UART_FR) & FR_TXFF) { }
-    mmio_write(UART_DR, c);
+    unsigned long flags;
+    spin_lock_irqsave(&tx_lock, flags);
+    tx_put(c);
+    tx_start();
+    spin_unlock_irqrestore(&tx_lock, flags);
 }
 
+// one lock hold per string, so lines from different CPUs do not interleave
 void uart_puts(const char *s) {
+    unsigned long flags;
+    spin_lock_irqsave(&tx_lock, flags);
     while (*s) {
         if (*s == '\n') {
-            uart_putc('\r');
-        }
-        uart_putc(*s++);
-        
-        if ((s - (const char *)0) % 8 == 0) {
-            while (mmio_read(UART_FR) & FR_BUSY) { }
+            tx_put('\r');
         }
+        tx_put(*s++);
     }
-    
-    while (mmio_read(UART_FR) & FR_BUSY) { }
+    tx_start();
+    spin_unlock_irqrestore(&tx_lock, flags);
 }
 
 
 void uart_hex(unsigned long n) {
-    uart_puts("0x");
-    for(int i = 60; i >= 0; i -= 4) {
-        int digit = (n >> i) & 0xF;
-        uart_putc(digit + (digit < 10 ? '0' : 'a' - 10));
+    char buf[18] = { '0', 'x' };
+    for (int i = 0; i < 16; i++) {
+        int digit = (n >> (60 - 4 * i)) & 0xF;
+        buf[2 + i] = digit + (digit < 10 ? '0' : 'a' - 10);
+    }
+    unsigned long flags;
+    spin_lock_irqsave(&tx_lock, flags);
+    for (int i = 0; i < 18; i++) {
+        tx_put(buf[i]);
+    }
+    tx_start();
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
+/*
+ * received characters are moved from the FIFO into rx_buf by the
+ * interrupt, readers take them from there and sleep on rx_wait while it
+ * is empty. before the interrupt is on, or with nothing buffered, a reader
+ * looks at the FIFO itself. rx_lock keeps the two apart.
+ */
+#define RX_BUF_SIZE 256     /* power of two */
+
+static char rx_buf[RX_BUF_SIZE];
+static unsigned int rx_head, rx_tail;  /* free running, masked on use */
+static spinlock_t rx_lock = SPINLOCK_INIT;
+static struct wait_queue rx_wait = WAIT_QUEUE_INIT;
+
+void uart_enable_irq(void) {
+    unsigned long flags;
+    spin_lock_irqsave(&tx_lock, flags);
+    mmio_write(UART_ICR, INT_RX | INT_TX | INT_RT);
+    mmio_write(UART_IMSC, mmio_read(UART_IMSC) | INT_RX | INT_RT);
+    tx_irq_on = 1;
+    spin_unlock_irqrestore(&tx_lock, flags);
+    gic_enable_interrupt(UART_IRQ);
+}
+
+// refills the TX FIFO, masking the interrupt once tx_buf is empty
+static void uart_tx_irq(void) {
+    spin_lock(&tx_lock);
+    tx_fill();
+    if (tx_head == tx_tail) {
+        mmio_write(UART_IMSC, mmio_read(UART_IMSC) & ~INT_TX);
+    }
+    mmio_write(UART_ICR, INT_TX);
+    spin_unlock(&tx_lock);
+}
+
+// drains the RX FIFO, a full buffer drops what does not fit
+static void uart_rx_irq(void) {
+    int got = 0;
+    spin_lock(&rx_lock);
+    while (!(mmio_read(UART_FR) & FR_RXFE)) {
+        char c = mmio_read(UART_DR) & 0xFF;
+        if (rx_head - rx_tail < RX_BUF_SIZE) {
+            rx_buf[rx_head++ & (RX_BUF_SIZE - 1)] = c;
+            got = 1;
+        }
+    }
+    mmio_write(UART_ICR, INT_RX | INT_RT);
+    spin_unlock(&rx_lock);
+
+    if (got) {
+        kernel_lock();
+        wake_up_all(&rx_wait);
+        kernel_unlock();
+    }
+}
+
+void uart_irq(void) {
+    unsigned int mis = mmio_read(UART_MIS);
+    if (mis & INT_TX) {
+        uart_tx_irq();
     }
+    if (mis & (INT_RX | INT_RT)) {
+        uart_rx_irq();
+    }
+}
+
+int uart_try_getc(void) {
+    unsigned long flags;
+    int c = -1;
+    spin_lock_irqsave(&rx_lock, flags);
+    if (rx_head != rx_tail) {
+        c = (unsigned char)rx_buf[rx_tail++ & (RX_BUF_SIZE - 1)];
+    } else if (!(mmio_read(UART_FR) & FR_RXFE)) {
+        c = mmio_read(UART_DR) & 0xFF;
+    }
+    spin_unlock_irqrestore(&rx_lock, flags);
+    return c;
 }
 
 char uart_getc(void) {
-    while (mmio_read(UART_FR) & FR_RXFE) { }  
-    return mmio_read(UART_DR) & 0xFF;  
+    int c;
+    while ((c = uart_try_getc()) < 0) { }
+    return c;
+}
+
+char uart_getc_sleep(void) {
+    int c;
+    wait_event(&rx_wait, (c = uart_try_getc()) >= 0);
+    return c;
 }
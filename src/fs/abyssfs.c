@@ -1,7 +1,10 @@
 #include "abyssfs.h"
 #include "kmalloc.h"
+#include "page_alloc.h"
 #include "uart.h"
 #include "string.h"
+#include "klog.h"
+#include "kprintf.h"
 #include <stddef.h>
 #include "vfs.h"  
 #include "process.h"  
@@ -25,6 +28,9 @@ static int abyssfs_unlink(const char *path);
 static struct abyssfs_inode* get_inode_by_path(const char *path);
 static int abyssfs_mkdir(const char *path);
 static int abyssfs_remove_recursive(const char *path);
+static int abyssfs_map(const char *path, void **data, size_t *size);
+static void abyssfs_map_get(void *data);
+static void abyssfs_map_put(void *data);
 
 
 #define BLOCK_SIZE 4096
@@ -37,6 +43,11 @@ static struct {
 
 
 static uint64_t block_bitmap = 0;
+
+/* user mappings of each data block. an unlinked file's block stays
+   allocated until its last mapping goes away */
+static uint16_t block_maps[NUM_BLOCKS];
+static uint64_t block_unlinked = 0;
 static int abyssfs_initialized = 0;
 
 #define ABYSSFS_DIR_ENTRY_FIXED_SIZE (sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint8_t))
@@ -48,7 +59,7 @@ static inline uint8_t round_up(uint8_t val, uint8_t align) {
 
 
 static struct vfs_super_block* abyssfs_mount(void) {
-    struct vfs_super_block* vsb = kalloc(sizeof(struct vfs_super_block));
+    struct vfs_super_block* vsb = kalloc_tag(sizeof(struct vfs_super_block), KMEM_ABYSSFS);
     if (!vsb) return NULL;
 
     abyssfs_init();
@@ -77,7 +88,10 @@ struct filesystem_type abyssfs_fs_type = {
     .unlink = abyssfs_unlink,
     .read_dir = abyssfs_read_dir,
     .mkdir = abyssfs_mkdir,
-    .remove_recursive = abyssfs_remove_recursive
+    .remove_recursive = abyssfs_remove_recursive,
+    .map = abyssfs_map,
+    .map_get = abyssfs_map_get,
+    .map_put = abyssfs_map_put
 };
 
 
@@ -88,8 +102,8 @@ void abyssfs_init(void) {
         return;
     }
     
-    size_t total_size = BLOCK_SIZE * 64;
-    abyssfs.blocks = kalloc(total_size);
+    size_t total_size = BLOCK_SIZE * NUM_BLOCKS;
+    abyssfs.blocks = page_alloc(get_order(total_size));
     if (!abyssfs.blocks) {
         uart_puts("Failed to allocate AbyssFS blocks\n");
         return;
@@ -99,18 +113,14 @@ void abyssfs_init(void) {
     
     abyssfs.sb.magic = ABYSSFS_MAGIC;
     abyssfs.sb.block_size = BLOCK_SIZE;
-    abyssfs.sb.total_blocks = 64;  
+    abyssfs.sb.total_blocks = NUM_BLOCKS;  
     abyssfs.sb.inode_blocks = 8;   
     abyssfs.sb.data_blocks = abyssfs.sb.total_blocks - abyssfs.sb.inode_blocks - 1;
     abyssfs.sb.free_blocks = abyssfs.sb.data_blocks;
     abyssfs.sb.first_data_block = abyssfs.sb.inode_blocks + 1;
     
-    uart_puts("AbyssFS initialized with ");
-    uart_putc('0' + abyssfs.sb.total_blocks/10);
-    uart_putc('0' + abyssfs.sb.total_blocks%10);
-    uart_puts(" blocks (");
-    uart_putc('0' + abyssfs.sb.inode_blocks);
-    uart_puts(" inode blocks)\n");
+    klog(KLOG_INFO, "AbyssFS initialized with %u blocks (%u inode blocks)",
+         abyssfs.sb.total_blocks, abyssfs.sb.inode_blocks);
 
     
     for (uint32_t i = 0; i < abyssfs.sb.inode_blocks; i++) {
@@ -164,11 +174,7 @@ if (root_inode) {
 
 
 static void debug_dir_entry(struct abyssfs_dir_entry *dir) {
-    uart_puts("Dir entry: inode=");
-    uart_putc('0' + dir->inode);
-    uart_puts(", name=");
-    uart_puts(dir->name);
-    uart_puts("\n");
+    kprintf("Dir entry: inode=%u, name=%s\n", dir->inode, dir->name);
 }
 
 
@@ -325,6 +331,11 @@ static uint32_t alloc_block(void) {
 
 static void free_block(uint32_t block_num) {
     if (block_num < abyssfs.sb.total_blocks) {
+        if (block_maps[block_num]) {
+            // still mapped, abyssfs_map_put frees it
+            block_unlinked |= (1ULL << block_num);
+            return;
+        }
         block_bitmap &= ~(1ULL << block_num);
         abyssfs.sb.free_blocks++;
     }
@@ -350,27 +361,12 @@ static uint32_t alloc_inode(void) {
     uint32_t inodes_per_block = BLOCK_SIZE / sizeof(struct abyssfs_inode);
     uint32_t max_inodes = abyssfs.sb.inode_blocks * inodes_per_block;
     
-    //uart_puts("Searching for free inode (max: ");
-    
-    /*if (max_inodes >= 100) {
-        uart_putc('0' + (max_inodes/100));
-        uart_putc('0' + ((max_inodes/10)%10));
-        uart_putc('0' + (max_inodes%10));
-    } else if (max_inodes >= 10) {
-        uart_putc('0' + (max_inodes/10));
-        uart_putc('0' + (max_inodes%10));
-    } else {
-        uart_putc('0' + max_inodes);
-    }
-    uart_puts(")\n");*/
-    
+    klog(KLOG_DEBUG, "Searching for free inode (max: %u)", max_inodes);
     
     for (uint32_t i = 1; i < max_inodes; i++) {
         struct abyssfs_inode* inode = get_inode(i);
         if (!inode) {
-            uart_puts("Failed to get inode ");
-            uart_putc('0' + i);
-            uart_puts("\n");
+            kprintf("Failed to get inode %u\n", i);
             continue;
         }
         if (inode->mode == 0) {
@@ -386,9 +382,7 @@ static uint32_t alloc_inode(void) {
 
 void test_inode_alloc(void) {
     uint32_t inode = alloc_inode();
-    uart_puts("Allocated inode: ");
-    uart_putc('0' + inode);
-    uart_puts("\n");
+    kprintf("Allocated inode: %u\n", inode);
 }
 
 
@@ -397,9 +391,7 @@ void test_abyssfs(void) {
     
     uart_puts("Testing inode allocation:\n");
     uint32_t inode_num = alloc_inode();
-    uart_puts("Allocated inode: ");
-    uart_putc('0' + inode_num);
-    uart_puts("\n");
+    kprintf("Allocated inode: %u\n", inode_num);
     
     struct abyssfs_inode *inode = get_inode(inode_num);
     if (inode) {
@@ -412,9 +404,7 @@ void test_abyssfs(void) {
         return;
     }
     
-    uart_puts("About to create file with inode: ");
-    uart_putc('0' + inode_num);
-    uart_puts("\n");
+    kprintf("About to create file with inode: %u\n", inode_num);
     
     const char *test_file = "hello.txt";
     if (create_file(test_file, inode_num) == 0) {
@@ -452,7 +442,7 @@ struct filesystem_type* abyssfs_get_fs_type(void) {
         return NULL;
     }
     
-    struct vfs_file *file = kalloc(sizeof(struct vfs_file));
+    struct vfs_file *file = vfs_file_alloc();
     if (!file) {
         
         return NULL;
@@ -469,7 +459,7 @@ struct filesystem_type* abyssfs_get_fs_type(void) {
 static struct vfs_file* abyssfs_open(const char *path) {
     
     
-    struct vfs_file *file = kalloc(sizeof(struct vfs_file));
+    struct vfs_file *file = vfs_file_alloc();
     if (!file) return NULL;
     
     
@@ -571,7 +561,7 @@ static int allocate_blocks(void) {
         return 0;
     }
 
-    abyssfs.blocks = kalloc(BLOCK_SIZE * NUM_BLOCKS);
+    abyssfs.blocks = page_alloc(get_order(BLOCK_SIZE * NUM_BLOCKS));
     if (!abyssfs.blocks) {
         //uart_puts("FORCE DEBUG - Failed to allocate blocks\n");
         return -1;
@@ -604,7 +594,7 @@ static struct vfs_file *abyssfs_create_file(const char *path) {
     }
 
     
-    struct vfs_file *file = kalloc(sizeof(struct vfs_file));
+    struct vfs_file *file = vfs_file_alloc();
     if (!file) {
         return NULL;
     }
@@ -913,4 +903,57 @@ static int abyssfs_remove_recursive(const char *path) {
     
     
     return abyssfs_unlink(path);
-}
\ No newline at end of file
+}
+
+/*
+ * a file's data is the one block at inode->blocks, write_to_blocks never
+ * stores more, whatever inode->size says. blocks are page sized and the
+ * block area is page aligned, so the page can go straight into a user
+ * address space. the block area is never freed, and data blocks are never
+ * the head page of it, so the mappings hold no page references. each
+ * mapping counts in block_maps instead, which keeps unlink from handing
+ * the block to another file while it is still mapped.
+ */
+static int abyssfs_map(const char *path, void **data, size_t *size) {
+    struct abyssfs_inode *inode = get_inode_by_path(path);
+    if (!inode || (inode->mode & 0x4000) || inode->size == 0) {
+        return -1;
+    }
+    if (inode->blocks < abyssfs.sb.first_data_block ||
+        inode->blocks >= abyssfs.sb.total_blocks) {
+        return -1;
+    }
+    *data = abyssfs.blocks + inode->blocks * BLOCK_SIZE;
+    *size = inode->size < BLOCK_SIZE ? inode->size : BLOCK_SIZE;
+    block_maps[inode->blocks]++;
+    return 0;
+}
+
+// data block behind a mapped address, 0 if it is not ours
+static uint32_t mapped_block(void *data) {
+    uint8_t *p = data;
+    if (!abyssfs.blocks ||
+        p < abyssfs.blocks + abyssfs.sb.first_data_block * BLOCK_SIZE ||
+        p >= abyssfs.blocks + abyssfs.sb.total_blocks * BLOCK_SIZE) {
+        return 0;
+    }
+    return (p - abyssfs.blocks) / BLOCK_SIZE;
+}
+
+static void abyssfs_map_get(void *data) {
+    uint32_t block = mapped_block(data);
+    if (block) {
+        block_maps[block]++;
+    }
+}
+
+static void abyssfs_map_put(void *data) {
+    uint32_t block = mapped_block(data);
+    if (!block || !block_maps[block]) {
+        return;
+    }
+    if (--block_maps[block] == 0 && (block_unlinked & (1ULL << block))) {
+        block_unlinked &= ~(1ULL << block);
+        free_block(block);
+    }
+}
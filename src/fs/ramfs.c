@@ -3,6 +3,7 @@
 #include "uart.h"
 #include "vfs.h"
 #include "kmalloc.h"
+#include "klog.h"
 #include <stdint.h>
 
 #define RAMFS_MAGIC 0x52414D46  
@@ -90,9 +91,8 @@ static ssize_t ramfs_write(struct vfs_file *file, const void *buf, size_t count)
     
     
     if (file->f_pos + count > MAX_CONTENT) {
-        uart_puts("RAMFS: Would overflow, limiting to ");
-        uart_hex(MAX_CONTENT - file->f_pos);
-        uart_puts(" bytes\n");
+        klog(KLOG_WARN, "RAMFS: Would overflow, limiting to %zu bytes",
+             MAX_CONTENT - file->f_pos);
         count = MAX_CONTENT - file->f_pos;
     }
     
@@ -100,11 +100,8 @@ static ssize_t ramfs_write(struct vfs_file *file, const void *buf, size_t count)
         memcpy(rf->content + file->f_pos, buf, count);
         file->f_pos += count;
         if (file->f_pos > rf->size) {
-            uart_puts("RAMFS: Updating size from ");
-            uart_hex(rf->size);
-            uart_puts(" to ");
-            uart_hex(file->f_pos);
-            uart_puts("\n");
+            klog(KLOG_DEBUG, "RAMFS: Updating size from %zu to %zu",
+                 rf->size, file->f_pos);
             rf->size = file->f_pos;
         }
         //uart_puts("RAMFS: Write successful\n");
@@ -132,7 +129,7 @@ static struct vfs_file *ramfs_open(const char *path) {
     }
     
     
-    struct vfs_file *file = kalloc(sizeof(struct vfs_file));
+    struct vfs_file *file = vfs_file_alloc();
     if (!file) {
         return NULL;
     }
@@ -221,7 +218,7 @@ int ramfs_read_file(const char *path, char *out, int max_len)
 static struct vfs_super_block* ramfs_mount(void) {
     uart_puts("RAMFS: Mounting filesystem\n");
     
-    struct vfs_super_block *sb = kalloc(sizeof(struct vfs_super_block));
+    struct vfs_super_block *sb = kalloc_tag(sizeof(struct vfs_super_block), KMEM_VFS);
     if (!sb) {
         uart_puts("RAMFS: Failed to allocate superblock\n");
         return NULL;
@@ -383,7 +380,7 @@ static struct vfs_file *ramfs_create(const char *path) {
     files[i].content[0] = '\0';
 
     
-    struct vfs_file *file = kalloc(sizeof(struct vfs_file));
+    struct vfs_file *file = vfs_file_alloc();
     if (!file) {
         files[i].used = 0;
         return NULL;
@@ -1,7 +1,10 @@
 #include "vfs.h"
 #include "uart.h"
 #include "kmalloc.h"
+#include "pool.h"
+#include "scratch.h"
 #include "string.h"
+#include "klog.h"
 #include "namespace.h"
 #include "process.h"  
 #include "abyssfs.h"  
@@ -29,7 +32,17 @@ static int num_mounts = 0;
 
 #define MAX_FD 32
 static struct vfs_file *fd_table[MAX_FD];
-static int next_fd = 0;
+
+// open files are recycled through a pool instead of the heap
+static DEFINE_POOL(vfs_file_pool, struct vfs_file);
+
+struct vfs_file *vfs_file_alloc(void) {
+    return pool_alloc(&vfs_file_pool);
+}
+
+void vfs_file_free(struct vfs_file *file) {
+    pool_free(&vfs_file_pool, file);
+}
 
 
 static char* resolve_namespace_path(const char *path);
@@ -164,14 +177,15 @@ static struct mount *find_mount(const char *path) {
 
 
 static int alloc_fd(struct vfs_file *file) {
-    
-    if (next_fd >= MAX_FD) {
-        uart_puts("VFS: No free file descriptors\n");
-        return -1;
+    // lowest free slot, closed descriptors get reused
+    for (int fd = 0; fd < MAX_FD; fd++) {
+        if (!fd_table[fd]) {
+            fd_table[fd] = file;
+            return fd;
+        }
     }
-    fd_table[next_fd] = file;
-    
-    return next_fd++;
+    uart_puts("VFS: No free file descriptors\n");
+    return -1;
 }
 
 
@@ -188,7 +202,11 @@ int vfs_read_dir(const char *path, struct dirent *dirents, int max_entries) {
     //uart_puts(path);
     //uart_puts("\n");
 
+    size_t mark = scratch_mark();
     char *resolved_path = resolve_namespace_path(path);
+    if (!resolved_path) {
+        return -1;
+    }
     //uart_puts("VFS: Reading directory after namespace resolution: ");
     //uart_puts(resolved_path);
     //uart_puts("\n");
@@ -196,12 +214,15 @@ int vfs_read_dir(const char *path, struct dirent *dirents, int max_entries) {
     struct mount *mp = find_mount(resolved_path);
     if (!mp) {
         uart_puts("VFS: No mount point found for path\n");
+        scratch_release(mark);
         return -1;
     }
 
     //uart_puts("VFS: Found mount point, calling filesystem read_dir\n");
     
-    return mp->fs->read_dir(resolved_path, dirents, max_entries);
+    int count = mp->fs->read_dir(resolved_path, dirents, max_entries);
+    scratch_release(mark);
+    return count;
 }
 
 
@@ -224,8 +245,9 @@ static char* resolve_namespace_path(const char *path) {
 
         size_t new_len = strlen(ns->new_path);
         if (strncmp(path, ns->new_path, new_len) == 0) {
-            char *resolved = kalloc(VFS_MAX_PATH);
-            if (!resolved) return (char*)path;
+            // lives in the scratch arena, the caller releases it
+            char *resolved = scratch_alloc(VFS_MAX_PATH);
+            if (!resolved) return NULL;
             
             strcpy(resolved, ns->old_path);
             
@@ -250,9 +272,10 @@ static char* resolve_namespace_path(const char *path) {
 
 
 int vfs_open(const char* path) {
-    
-    char resolved_path[VFS_MAX_PATH];
-    if (resolve_path(path, resolved_path) < 0) {
+    size_t mark = scratch_mark();
+    char *resolved_path = scratch_alloc(VFS_MAX_PATH);
+    if (!resolved_path || resolve_path(path, resolved_path) < 0) {
+        scratch_release(mark);
         return -1;
     }
     
@@ -265,14 +288,16 @@ int vfs_open(const char* path) {
 
     struct vfs_file* file = fs->open(resolved_path);
     if (!file) {
-        uart_puts("VFS: Failed to open file\n");
+        klog(KLOG_WARN, "VFS: Failed to open file %s", resolved_path);
+        scratch_release(mark);
         return -1;
     }
+    scratch_release(mark);
 
     int fd = alloc_fd(file);
     if (fd < 0) {
-        uart_puts("VFS: Failed to allocate fd\n");
-        
+        klog(KLOG_WARN, "VFS: Failed to allocate fd");
+        vfs_file_free(file);
         return -1;
     }
 
@@ -351,8 +376,12 @@ int handle_read_dir_message(struct Message *msg) {
         return -1;
     }
 
-    static struct dirent dirents[32];  // static array for kernel use
     int max_entries = 32;
+    size_t mark = scratch_mark();
+    struct dirent *dirents = scratch_alloc(max_entries * sizeof(struct dirent));
+    if (!dirents) {
+        return -1;
+    }
 
     //uart_puts("VFS: About to call vfs_read_dir\n");
     int entry_count = vfs_read_dir(msg->path, dirents, max_entries);
@@ -387,6 +416,7 @@ int handle_read_dir_message(struct Message *msg) {
         }
     }
 
+    scratch_release(mark);
     return entry_count;
 }
 
@@ -408,10 +438,12 @@ int resolve_path(const char *path, char *resolved) {
     return 0;
 }
 
-int vfs_create(const char *path) {
-    char full_path[VFS_MAX_PATH];
+// joins a relative path onto the cwd in the scratch arena, the caller
+// releases it
+static char *absolute_path(const char *path) {
+    char *full_path = scratch_alloc(VFS_MAX_PATH);
+    if (!full_path) return NULL;
 
-    
     if (path[0] != '/') {
         strcpy(full_path, current_process->cwd);
         if (full_path[strlen(full_path)-1] != '/') {
@@ -421,28 +453,39 @@ int vfs_create(const char *path) {
     } else {
         strcpy(full_path, path);
     }
+    return full_path;
+}
 
-    
+static struct vfs_file *create_file(const char *full_path) {
     if (strncmp(full_path, "/tmp/", 5) == 0 || strcmp(full_path, "/tmp") == 0) {
         struct vfs_file *file = ramfs_fs_type.create(full_path);
         if (!file) {
             uart_puts("VFS: Failed to create file in RAMFS\n");
-            return -1;
         }
-        return alloc_fd(file);
-    } else {
-        struct mount *mp = find_mount(full_path);
-        if (!mp || !mp->fs->create) {
-            uart_puts("VFS: No mount point or create operation for path\n");
-            return -1;
-        }
-        struct vfs_file *file = mp->fs->create(full_path);
-        if (!file) {
-            uart_puts("VFS: Failed to create file in filesystem\n");
-            return -1;
-        }
-        return alloc_fd(file);
+        return file;
+    }
+
+    struct mount *mp = find_mount(full_path);
+    if (!mp || !mp->fs->create) {
+        uart_puts("VFS: No mount point or create operation for path\n");
+        return NULL;
+    }
+    struct vfs_file *file = mp->fs->create(full_path);
+    if (!file) {
+        uart_puts("VFS: Failed to create file in filesystem\n");
     }
+    return file;
+}
+
+int vfs_create(const char *path) {
+    size_t mark = scratch_mark();
+    char *full_path = absolute_path(path);
+    struct vfs_file *file = full_path ? create_file(full_path) : NULL;
+    scratch_release(mark);
+    if (!file) {
+        return -1;
+    }
+    return alloc_fd(file);
 }
 
 int vfs_close(int fd) {
@@ -456,7 +499,7 @@ int vfs_close(int fd) {
         file->f_ops->close(file);
     }
     
-    kfree(file);
+    vfs_file_free(file);
     fd_table[fd] = NULL;
     
     return 0;
@@ -467,20 +510,10 @@ int vfs_unlink(const char *path) {
     //uart_puts(path);
     //uart_puts("\n");
     
-    char full_path[VFS_MAX_PATH];
-    if (path[0] != '/') {
-        
-        strcpy(full_path, current_process->cwd);
-        if (full_path[strlen(full_path)-1] != '/') {
-            strcat(full_path, "/");
-        }
-        strcat(full_path, path);
-    } else {
-        strcpy(full_path, path);
-    }
-
-    
-    struct mount *mp = find_mount(full_path);
+    size_t mark = scratch_mark();
+    char *full_path = absolute_path(path);
+    struct mount *mp = full_path ? find_mount(full_path) : NULL;
+    scratch_release(mark);
     if (!mp) {
         uart_puts("VFS: No mount point found\n");
         return -1;
@@ -494,27 +527,23 @@ int vfs_mkdir(const char *path) {
     //uart_puts(path);
     //uart_puts("\n");
 
-    
-    char full_path[VFS_MAX_PATH];
-    if (path[0] != '/') {
-        strcpy(full_path, current_process->cwd);
-        if (full_path[strlen(full_path)-1] != '/') {
-            strcat(full_path, "/");
-        }
-        strcat(full_path, path);
-    } else {
-        strcpy(full_path, path);
+    size_t mark = scratch_mark();
+    char *full_path = absolute_path(path);
+    if (!full_path) {
+        scratch_release(mark);
+        return -1;
     }
 
-    
     struct mount *mp = find_mount(full_path);
     if (!mp) {
         uart_puts("VFS: No mount point found\n");
+        scratch_release(mark);
         return -1;
     }
 
-    
-    return mp->fs->mkdir(full_path);
+    int ret = mp->fs->mkdir(full_path);
+    scratch_release(mark);
+    return ret;
 }
 
 int vfs_remove_recursive(const char *path) {
@@ -522,23 +551,68 @@ int vfs_remove_recursive(const char *path) {
         return -1;
     }
     
-    
-    char full_path[VFS_MAX_PATH];
-    if (path[0] != '/') {
-        strcpy(full_path, current_process->cwd);
-        if (full_path[strlen(full_path) - 1] != '/') {
-            strcat(full_path, "/");
-        }
-        strcat(full_path, path);
-    } else {
-        strcpy(full_path, path);
+    size_t mark = scratch_mark();
+    char *full_path = absolute_path(path);
+    if (!full_path) {
+        scratch_release(mark);
+        return -1;
     }
-    
+
     struct mount *mp = find_mount(full_path);
     if (!mp || !mp->fs->remove_recursive) {
         uart_puts("VFS: Filesystem does not support recursive remove\n");
+        scratch_release(mark);
         return -1;
     }
-    
-    return mp->fs->remove_recursive(full_path);
-}
\ No newline at end of file
+
+    int ret = mp->fs->remove_recursive(full_path);
+    scratch_release(mark);
+    return ret;
+}
+
+int vfs_map(const char *path, void **data, size_t *size) {
+    if (!path) {
+        return -1;
+    }
+    size_t mark = scratch_mark();
+    char *resolved_path = scratch_alloc(VFS_MAX_PATH);
+    if (!resolved_path || resolve_path(path, resolved_path) < 0) {
+        scratch_release(mark);
+        return -1;
+    }
+
+    struct filesystem_type *fs = NULL;
+    if (strncmp(resolved_path, "/tmp/", 5) == 0) {
+        fs = &ramfs_fs_type;
+    } else {
+        fs = &abyssfs_fs_type;
+    }
+    if (!fs->map) {
+        uart_puts("VFS: Filesystem does not support mapping\n");
+        scratch_release(mark);
+        return -1;
+    }
+    int ret = fs->map(resolved_path, data, size);
+    scratch_release(mark);
+    return ret;
+}
+
+// mappings are known by their data address alone, a filesystem ignores
+// addresses outside its own storage
+static struct filesystem_type *const mappable_fs[] = { &ramfs_fs_type, &abyssfs_fs_type };
+
+void vfs_map_get(void *data) {
+    for (size_t i = 0; i < sizeof(mappable_fs) / sizeof(mappable_fs[0]); i++) {
+        if (mappable_fs[i]->map_get) {
+            mappable_fs[i]->map_get(data);
+        }
+    }
+}
+
+void vfs_map_put(void *data) {
+    for (size_t i = 0; i < sizeof(mappable_fs) / sizeof(mappable_fs[0]); i++) {
+        if (mappable_fs[i]->map_put) {
+            mappable_fs[i]->map_put(data);
+        }
+    }
+}
@@ -0,0 +1,220 @@
+#include "fdt.h"
+#include "string.h"
+
+/*
+ * just enough flattened device tree parsing to find out how much RAM
+ * the machine has, and which CPUs PSCI can start. the blob is big endian, tokens are 4 byte aligned.
+ */
+
+#define FDT_BEGIN_NODE  1
+#define FDT_END_NODE    2
+#define FDT_PROP        3
+#define FDT_NOP         4
+#define FDT_END         9
+
+struct fdt_header {
+    uint32_t magic;
+    uint32_t totalsize;
+    uint32_t off_dt_struct;
+    uint32_t off_dt_strings;
+    uint32_t off_mem_rsvmap;
+    uint32_t version;
+    uint32_t last_comp_version;
+    uint32_t boot_cpuid_phys;
+    uint32_t size_dt_strings;
+    uint32_t size_dt_struct;
+};
+
+static inline uint32_t be32(uint32_t v) {
+    return __builtin_bswap32(v);
+}
+
+static uint64_t read_cells(const uint32_t *p, uint32_t cells) {
+    uint64_t v = 0;
+    for (uint32_t i = 0; i < cells; i++) {
+        v = (v << 32) | be32(p[i]);
+    }
+    return v;
+}
+
+int fdt_valid(const void *fdt) {
+    const struct fdt_header *h = fdt;
+    return h && be32(h->magic) == FDT_MAGIC;
+}
+
+uint32_t fdt_total_size(const void *fdt) {
+    const struct fdt_header *h = fdt;
+    return be32(h->totalsize);
+}
+
+// first reg entry of the /memory node, 0 on success
+int fdt_memory_range(const void *fdt, uint64_t *base, uint64_t *size) {
+    if (!fdt_valid(fdt)) {
+        return -1;
+    }
+
+    const struct fdt_header *h = fdt;
+    const char *strings = (const char *)fdt + be32(h->off_dt_strings);
+    const uint32_t *p = (const uint32_t *)((const char *)fdt + be32(h->off_dt_struct));
+
+    /* spec defaults, the root node normally overrides them */
+    uint32_t addr_cells = 2;
+    uint32_t size_cells = 1;
+    int depth = 0;
+    int in_memory = 0;
+
+    for (;;) {
+        uint32_t token = be32(*p++);
+        switch (token) {
+            case FDT_BEGIN_NODE: {
+                const char *name = (const char *)p;
+                size_t len = strlen(name);
+                depth++;
+                in_memory = (depth == 2 && strncmp(name, "memory", 6) == 0 &&
+                             (name[6] == '\0' || name[6] == '@'));
+                p += (len + 1 + 3) / 4;
+                break;
+            }
+            case FDT_END_NODE:
+                depth--;
+                in_memory = 0;
+                break;
+            case FDT_PROP: {
+                uint32_t len = be32(p[0]);
+                const char *name = strings + be32(p[1]);
+                const uint32_t *val = p + 2;
+
+                if (depth == 1 && strcmp(name, "#address-cells") == 0) {
+                    addr_cells = be32(val[0]);
+                } else if (depth == 1 && strcmp(name, "#size-cells") == 0) {
+                    size_cells = be32(val[0]);
+                } else if (in_memory && strcmp(name, "reg") == 0 &&
+                           len >= (addr_cells + size_cells) * 4) {
+                    *base = read_cells(val, addr_cells);
+                    *size = read_cells(val + addr_cells, size_cells);
+                    return 0;
+                }
+                p = val + (len + 3) / 4;
+                break;
+            }
+            case FDT_NOP:
+                break;
+            case FDT_END:
+            default:
+                return -1;
+        }
+    }
+}
+
+/*
+ * calls visit for every node (prop NULL) and every property, with the
+ * name of the node being in. a nonzero return from visit stops the walk
+ * and is passed back, 0 means the walk went through the whole tree
+ */
+typedef int (*fdt_visit_t)(int depth, const char *node, const char *prop,
+                           const uint32_t *val, uint32_t len, void *ctx);
+
+static int fdt_walk(const void *fdt, fdt_visit_t visit, void *ctx) {
+    if (!fdt_valid(fdt)) {
+        return -1;
+    }
+
+    const struct fdt_header *h = fdt;
+    const char *strings = (const char *)fdt + be32(h->off_dt_strings);
+    const uint32_t *p = (const uint32_t *)((const char *)fdt + be32(h->off_dt_struct));
+    const char *node = "";
+    int depth = 0;
+    int ret;
+
+    for (;;) {
+        uint32_t token = be32(*p++);
+        switch (token) {
+            case FDT_BEGIN_NODE:
+                node = (const char *)p;
+                depth++;
+                if ((ret = visit(depth, node, NULL, NULL, 0, ctx)) != 0) {
+                    return ret;
+                }
+                p += (strlen(node) + 1 + 3) / 4;
+                break;
+            case FDT_END_NODE:
+                depth--;
+                node = "";
+                break;
+            case FDT_PROP: {
+                uint32_t len = be32(p[0]);
+                const uint32_t *val = p + 2;
+                if ((ret = visit(depth, node, strings + be32(p[1]), val, len, ctx)) != 0) {
+                    return ret;
+                }
+                p = val + (len + 3) / 4;
+                break;
+            }
+            case FDT_NOP:
+                break;
+            case FDT_END:
+                return 0;
+            default:
+                return -1;
+        }
+    }
+}
+
+static int node_is(const char *node, const char *name) {
+    size_t n = strlen(name);
+    return strncmp(node, name, n) == 0 && (node[n] == '\0' || node[n] == '@');
+}
+
+static int psci_visit(int depth, const char *node, const char *prop,
+                      const uint32_t *val, uint32_t len, void *ctx) {
+    if (depth != 2 || !prop || !node_is(node, "psci") || strcmp(prop, "method") != 0) {
+        return 0;
+    }
+    const char *method = (const char *)val;
+    if (strcmp(method, "hvc") == 0) {
+        return FDT_PSCI_HVC;
+    }
+    if (strcmp(method, "smc") == 0) {
+        return FDT_PSCI_SMC;
+    }
+    return 0;
+}
+
+// conduit of the /psci node, FDT_PSCI_HVC or FDT_PSCI_SMC, -1 if there is none
+int fdt_psci_method(const void *fdt) {
+    int ret = fdt_walk(fdt, psci_visit, NULL);
+    return ret > 0 ? ret : -1;
+}
+
+struct cpus_ctx {
+    uint64_t *mpidr;
+    int max;
+    int count;
+    uint32_t addr_cells;
+    int in_cpu;
+};
+
+static int cpus_visit(int depth, const char *node, const char *prop,
+                      const uint32_t *val, uint32_t len, void *ctx) {
+    struct cpus_ctx *c = ctx;
+    if (!prop) {
+        c->in_cpu = depth == 3 && node_is(node, "cpu");
+        return 0;
+    }
+    if (depth == 2 && node_is(node, "cpus") && strcmp(prop, "#address-cells") == 0) {
+        c->addr_cells = be32(val[0]);
+    } else if (depth == 3 && c->in_cpu && strcmp(prop, "reg") == 0 &&
+               len >= c->addr_cells * 4 && c->count < c->max) {
+        c->mpidr[c->count++] = read_cells(val, c->addr_cells);
+    }
+    return 0;
+}
+
+// MPIDR affinity of every /cpus/cpu node in tree order, returns how many
+int fdt_cpus(const void *fdt, uint64_t *mpidr, int max) {
+    struct cpus_ctx c = { .mpidr = mpidr, .max = max, .count = 0, .addr_cells = 1 };
+    if (fdt_walk(fdt, cpus_visit, &c) < 0) {
+        return 0;
+    }
+    return c.count;
+}
@@ -2,16 +2,20 @@
 #include "ramfs.h"
 #include "timer.h"
 #include "gic.h"
+#include "exceptions.h"
 #include <stdint.h>
 #include "mmu.h"
 #include "process.h"
 #include "vfs.h"
 #include "kmalloc.h"
+#include "page_alloc.h"
+#include "memlayout.h"
 #include "abyssfs.h"
 #include "string.h"
 #include "message.h"
 #include <stddef.h>
 #include "shell.h"
+#include "klog.h"
 
 void test_vfs(void);
 void test_ramfs(void);
@@ -22,12 +26,12 @@ void test_ipc(void);
 void test_processes(void);
 void test_exec(void);
 
-extern void enter_usermode(unsigned long pc, unsigned long sp)
+extern void enter_usermode(unsigned long pc, unsigned long sp, unsigned long ksp)
         __attribute__((noreturn, naked));
 
-/* 0x8000 0000 user_shell.S */
-extern void _user_shell_start(void);
-extern void _user_shell_end(void);
+/* user_shell.S, linked at 0x8000 0000 but stored inside the kernel image */
+extern char _user_shell_image[];
+extern char _user_shell_image_end[];
 extern void process3(void);      
 
 void print_mmu_blocks(void)
@@ -40,8 +44,10 @@ void kernel_main(void)
 {
     uart_init();
     uart_puts("ChthonOS v0.1.0\n----------------\nBooting…\n\n");
+    smp_init();
 
     /* subsystems that do not enable interrupts */
+    page_alloc_init();
     mmu_init();
     process_init();
     vfs_init();
@@ -63,14 +69,28 @@ void kernel_main(void)
     /* enable timer/GIC and create EL0 task */
     timer_init();
     gic_init();
-
-    // user shell is already positioned at 0x80000000 by the linker
-    // no need to copy it, just use directly
-    uart_puts("User shell is already at 0x80000000, no copy needed\n");
-    
-    process_t *user = process_create((void*)0x80000000);  // user space address
-    user->sp    = 0x80000000 + 0x10000;
-    user->state = PROC_READY;
+    uart_enable_irq();
+
+    /* the other CPUs sit in their idle tasks until there is work */
+    smp_boot_secondaries();
+
+    /* from here on klog records reach the console through klogd */
+    klog_start();
+
+    // the user shell is linked at 0x80000000, the process gets its own copy
+    // of it mapped there, plus a private stack at the top of the user window
+    process_t *user = process_create((void*)USER_BASE);
+    if (!user ||
+        process_load_image(user, USER_BASE, _user_shell_image,
+                           _user_shell_image_end - _user_shell_image) < 0 ||
+        !(user->sp = process_setup_user_stack(user)) ||
+        process_start_user(user, user->ctx.pc, user->sp) < 0) {
+        uart_puts("PANIC: cannot set up user shell process\n");
+        for (;;)
+            asm volatile("wfe");
+    }
+    // entered directly below rather than through schedule()
+    set_process_state(user, PROC_RUNNING);
 
     /* drop to EL0  */
     uart_puts("Dropping to EL0!\n");
@@ -94,27 +114,46 @@ void kernel_main(void)
             asm volatile("wfe");
     }
 
+    mmu_switch(&user->mm);
+
+    // exceptions from EL0 land on the top of the shell's kernel stack
+    unsigned long ksp = (unsigned long)user->kstack + KSTACK_SIZE;
     __asm__ __volatile__(
         "mov x0, %0\n"
         "mov x1, %1\n"
+        "mov x2, %2\n"
         "b   enter_usermode\n"
-        :: "r"(user->ctx.pc), "r"(user->sp) : "x0", "x1");
+        :: "r"(user->ctx.pc), "r"(user->sp), "r"(ksp) : "x0", "x1", "x2");
 
     uart_puts("*** ERROR: returned from enter_usermode! ***\n");
     for (;;) asm volatile("wfe");
 }
 
-void handle_irq(void)
+void handle_irq(struct trap_frame *tf)
 {
-    uint64_t irq_status;
-    asm volatile("mrs %0, cntp_ctl_el0" : "=r"(irq_status));
-    if (irq_status & 4)
+    unsigned int iar = gic_acknowledge_interrupt();
+    unsigned int irq = GIC_IRQ_ID(iar);
+    if (irq >= GIC_SPURIOUS)
+        return;
+    if (irq == TIMER_IRQ)
         timer_handler();
+    else if (irq == IPI_RESCHEDULE)
+        sched_ipi();
+    else if (irq == UART_IRQ)
+        uart_irq();
+    gic_end_interrupt(iar);
+
+    /* only EL0 is preempted, the kernel runs until it returns or blocks */
+    if (TF_FROM_USER(tf) && sched_need_resched()) {
+        kernel_lock();
+        schedule();
+        kernel_unlock();
+    }
 }
 
 static struct vfs_super_block* test_mount(void)
 {
-    struct vfs_super_block* sb = kalloc(sizeof(*sb));
+    struct vfs_super_block* sb = kalloc_tag(sizeof(*sb), KMEM_VFS);
     if (!sb) return NULL;
     sb->s_magic   = 0x1234;
     sb->s_type    = "ramfs";
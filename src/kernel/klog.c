@@ -0,0 +1,262 @@
+#include <stdarg.h>
+#include "klog.h"
+#include "kprintf.h"
+#include "atomic.h"
+#include "spinlock.h"
+#include "waitqueue.h"
+#include "process.h"
+#include "string.h"
+#include "uart.h"
+#include "smp.h"
+
+/*
+ * one ring per CPU, written only by that CPU with IRQs masked, so
+ * producers never contend. klogd is the only consumer. a slot is reused
+ * once klogd has printed it. until then the writer drops new records
+ * rather than overwrite. each record carries the index it was written
+ * as, 0 while it is being filled, which lets klog_dump() copy records
+ * klogd is done with while they may be overwritten.
+ */
+
+struct klog_record {
+    volatile uint32_t seq;      /* index + 1, 0 while being written */
+    uint16_t len;
+    uint8_t level;
+    uint8_t cpu;
+    uint64_t stamp;             /* CNTPCT */
+    char text[KLOG_TEXT];
+};
+
+struct klog_ring {
+    struct klog_record rec[KLOG_RECORDS];
+    volatile uint32_t head;     /* next index written, owner CPU only */
+    volatile uint32_t drained;  /* next index klogd prints */
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t printed;
+} __attribute__((aligned(64)));
+
+static struct klog_ring rings[NR_CPUS];
+
+volatile int klog_level = KLOG_DEFAULT_LEVEL;
+
+static struct wait_queue klogd_wait = WAIT_QUEUE_INIT;
+static volatile int klogd_sleeping;
+static spinlock_t drain_lock = SPINLOCK_INIT;   /* klogd against klog_flush */
+
+static const char level_tag[] = "EWID";
+
+static inline uint64_t klog_now(void) {
+    uint64_t v;
+    __asm__ volatile("isb\n mrs %0, cntpct_el0" : "=r"(v));
+    return v;
+}
+
+void klog_emit(int level, const char *fmt, ...) {
+    unsigned long flags = local_irq_save();
+    int cpu = smp_processor_id();
+    struct klog_ring *r = &rings[cpu];
+    uint32_t idx = r->head;
+
+    if (idx - load_acquire32(&r->drained) >= KLOG_RECORDS) {
+        r->dropped++;
+        local_irq_restore(flags);
+        return;
+    }
+
+    struct klog_record *rec = &r->rec[idx & (KLOG_RECORDS - 1)];
+    rec->seq = 0;
+    __asm__ volatile("dmb ishst" ::: "memory");
+
+    va_list ap;
+    va_start(ap, fmt);
+    int len = kvsnprintf(rec->text, KLOG_TEXT, fmt, ap);
+    rec->len = len < KLOG_TEXT ? len : KLOG_TEXT - 1;
+    va_end(ap);
+    rec->level = level;
+    rec->cpu = cpu;
+    rec->stamp = klog_now();
+
+    store_release32(&rec->seq, idx + 1);
+    store_release32(&r->head, idx + 1);
+    r->written++;
+    local_irq_restore(flags);
+}
+
+int klog_set_level(int level) {
+    int old = klog_level;
+    if (level >= 0) {
+        klog_level = level > KLOG_DEBUG ? KLOG_DEBUG : level;
+    }
+    return old;
+}
+
+void klog_get_stats(struct klog_stats *out) {
+    out->written = out->dropped = out->printed = 0;
+    for (int i = 0; i < NR_CPUS; i++) {
+        out->written += rings[i].written;
+        out->dropped += rings[i].dropped;
+        out->printed += rings[i].printed;
+    }
+}
+
+static int klog_pending(void) {
+    for (int i = 0; i < NR_CPUS; i++) {
+        if (load_acquire32(&rings[i].head) != rings[i].drained) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// oldest record nobody has printed yet, across all CPUs
+static struct klog_ring *oldest_undrained(void) {
+    struct klog_ring *best = NULL;
+    uint64_t best_stamp = 0;
+    for (int i = 0; i < NR_CPUS; i++) {
+        struct klog_ring *r = &rings[i];
+        if (load_acquire32(&r->head) == r->drained) {
+            continue;
+        }
+        uint64_t stamp = r->rec[r->drained & (KLOG_RECORDS - 1)].stamp;
+        if (!best || stamp < best_stamp) {
+            best = r;
+            best_stamp = stamp;
+        }
+    }
+    return best;
+}
+
+// prints every waiting record in time order, the caller holds drain_lock
+static void klog_drain(void) {
+    struct klog_ring *r;
+    while ((r = oldest_undrained())) {
+        struct klog_record *rec = &r->rec[r->drained & (KLOG_RECORDS - 1)];
+        char line[KLOG_TEXT + 2];
+        memcpy(line, rec->text, rec->len);
+        line[rec->len] = '\r';
+        line[rec->len + 1] = '\n';
+        // the TX ring may be full, each call also moves some of it out
+        for (size_t off = 0; off < rec->len + 2u; ) {
+            off += uart_write(line + off, rec->len + 2 - off);
+        }
+        r->printed++;
+        store_release32(&r->drained, r->drained + 1);
+    }
+}
+
+void klog_flush(void) {
+    spin_lock(&drain_lock);
+    klog_drain();
+    spin_unlock(&drain_lock);
+    uart_flush();
+}
+
+int klog_need_drain(void) {
+    return klogd_sleeping && klog_pending();
+}
+
+void klog_poke(void) {
+    if (klog_need_drain()) {
+        klogd_sleeping = 0;
+        wake_up_one(&klogd_wait);
+    }
+}
+
+// IRQs are masked whenever it holds the kernel lock, an interrupt handler
+// on this CPU may want the lock too
+static void klogd(void) {
+    for (;;) {
+        kernel_lock();
+        while (!klog_pending()) {
+            klogd_sleeping = 1;
+            sleep_on(&klogd_wait);
+        }
+        klogd_sleeping = 0;
+        kernel_unlock();
+
+        __asm__ volatile("msr daifclr, #2" ::: "memory");
+        spin_lock(&drain_lock);
+        klog_drain();
+        spin_unlock(&drain_lock);
+        __asm__ volatile("msr daifset, #2" ::: "memory");
+    }
+}
+
+void klog_start(void) {
+    unsigned long flags = local_irq_save();
+    kernel_lock();
+    process_t *p = kthread_create(klogd);
+    kernel_unlock();
+    local_irq_restore(flags);
+    if (!p) {
+        uart_puts("klog: cannot start klogd, records stay in memory\n");
+    }
+}
+
+// one record as "[ms] L cpu text\n", 0 if it does not fit
+static size_t dump_record(char *buf, size_t size, const struct klog_record *rec, uint64_t freq) {
+    char head[40];
+    unsigned long ms = freq >= 1000 ? rec->stamp / (freq / 1000) : rec->stamp;
+    size_t hn = ksnprintf(head, sizeof(head), "[%lu] %c %u ", ms,
+                          level_tag[rec->level & 3], rec->cpu);
+
+    if (hn + rec->len + 1 > size) {
+        return 0;
+    }
+    memcpy(buf, head, hn);
+    memcpy(buf + hn, rec->text, rec->len);
+    buf[hn + rec->len] = '\n';
+    return hn + rec->len + 1;
+}
+
+// a stable copy of slot idx of r, 0 if it was overwritten meanwhile
+static int copy_record(struct klog_ring *r, uint32_t idx, struct klog_record *out) {
+    struct klog_record *rec = &r->rec[idx & (KLOG_RECORDS - 1)];
+    if (load_acquire32(&rec->seq) != idx + 1) {
+        return 0;
+    }
+    memcpy(out, rec, sizeof(*out));
+    __asm__ volatile("dmb ishld" ::: "memory");
+    return rec->seq == idx + 1 && out->len < KLOG_TEXT;
+}
+
+size_t klog_dump(char *buf, size_t size) {
+    uint32_t cur[NR_CPUS], end[NR_CPUS];
+    uint64_t freq;
+    size_t n = 0;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+
+    for (int i = 0; i < NR_CPUS; i++) {
+        end[i] = load_acquire32(&rings[i].head);
+        cur[i] = end[i] > KLOG_RECORDS ? end[i] - KLOG_RECORDS : 0;
+    }
+
+    for (;;) {
+        struct klog_record rec, best;
+        int best_cpu = -1;
+        for (int i = 0; i < NR_CPUS; i++) {
+            // skip whatever was overwritten since we started
+            while (cur[i] != end[i] && !copy_record(&rings[i], cur[i], &rec)) {
+                cur[i]++;
+            }
+            if (cur[i] == end[i]) {
+                continue;
+            }
+            if (best_cpu < 0 || rec.stamp < best.stamp) {
+                best = rec;
+                best_cpu = i;
+            }
+        }
+        if (best_cpu < 0) {
+            break;
+        }
+        cur[best_cpu]++;
+        size_t len = dump_record(buf + n, size - n, &best, freq);
+        if (!len) {
+            break;
+        }
+        n += len;
+    }
+    return n;
+}
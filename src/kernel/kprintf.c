@@ -0,0 +1,184 @@
+#include "kprintf.h"
+#include "uart.h"
+
+#define F_LEFT      1       /* - */
+#define F_ZERO      2       /* 0 */
+
+struct out {
+    char *buf;
+    size_t size;
+    size_t n;               /* would-be length, may run past size */
+};
+
+static inline void put(struct out *o, char c) {
+    if (o->n + 1 < o->size) {
+        o->buf[o->n] = c;
+    }
+    o->n++;
+}
+
+static void pad(struct out *o, char c, int count) {
+    while (count-- > 0) {
+        put(o, c);
+    }
+}
+
+// digits in reverse, then padding, sign and the digits in order
+static void put_number(struct out *o, unsigned long v, int base, int upper,
+                       int negative, int width, int flags, int min_digits) {
+    const char *digit = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[20];
+    int nd = 0;
+    do {
+        tmp[nd++] = digit[v % base];
+        v /= base;
+    } while (v);
+    while (nd < min_digits) {
+        tmp[nd++] = '0';
+    }
+
+    int len = nd + negative;
+    if (!(flags & F_LEFT) && !(flags & F_ZERO)) {
+        pad(o, ' ', width - len);
+    }
+    if (negative) {
+        put(o, '-');
+    }
+    if (!(flags & F_LEFT) && (flags & F_ZERO)) {
+        pad(o, '0', width - len);
+    }
+    while (nd) {
+        put(o, tmp[--nd]);
+    }
+    if (flags & F_LEFT) {
+        pad(o, ' ', width - len);
+    }
+}
+
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
+    struct out o = { buf, size, 0 };
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            put(&o, *fmt);
+            continue;
+        }
+
+        int flags = 0;
+        for (;;) {
+            if (*++fmt == '-') {
+                flags |= F_LEFT;
+            } else if (*fmt == '0') {
+                flags |= F_ZERO;
+            } else {
+                break;
+            }
+        }
+
+        int width = 0;
+        if (*fmt == '*') {
+            width = va_arg(ap, int);
+            if (width < 0) {
+                flags |= F_LEFT;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (*fmt++ - '0');
+            }
+        }
+
+        int is_long = 0;
+        if (*fmt == 'l') {
+            is_long = 1;
+            if (*++fmt == 'l') {
+                fmt++;
+            }
+        } else if (*fmt == 'z') {
+            is_long = 1;
+            fmt++;
+        }
+
+        switch (*fmt) {
+        case 'd':
+        case 'i': {
+            long d = is_long ? va_arg(ap, long) : va_arg(ap, int);
+            unsigned long v = d < 0 ? -(unsigned long)d : (unsigned long)d;
+            put_number(&o, v, 10, 0, d < 0, width, flags, 1);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X': {
+            unsigned long v = is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            put_number(&o, v, *fmt == 'u' ? 10 : 16, *fmt == 'X', 0, width, flags, 1);
+            break;
+        }
+        case 'p':
+            put(&o, '0');
+            put(&o, 'x');
+            put_number(&o, (unsigned long)va_arg(ap, void *), 16, 0, 0, 0, 0, 16);
+            break;
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            int len = 0;
+            if (!s) {
+                s = "(null)";
+            }
+            while (s[len]) {
+                len++;
+            }
+            if (!(flags & F_LEFT)) {
+                pad(&o, ' ', width - len);
+            }
+            for (int i = 0; i < len; i++) {
+                put(&o, s[i]);
+            }
+            if (flags & F_LEFT) {
+                pad(&o, ' ', width - len);
+            }
+            break;
+        }
+        case 'c':
+            if (!(flags & F_LEFT)) {
+                pad(&o, ' ', width - 1);
+            }
+            put(&o, (char)va_arg(ap, int));
+            if (flags & F_LEFT) {
+                pad(&o, ' ', width - 1);
+            }
+            break;
+        case '\0':
+            fmt--;
+            break;
+        default:
+            // %% and anything unknown come out as they are
+            put(&o, *fmt);
+            break;
+        }
+    }
+
+    if (size) {
+        buf[o.n < size ? o.n : size - 1] = '\0';
+    }
+    return (int)o.n;
+}
+
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = kvsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+int kprintf(const char *fmt, ...) {
+    char buf[KPRINTF_BUF_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = kvsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    uart_puts(buf);
+    return n;
+}
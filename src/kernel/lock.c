@@ -0,0 +1,155 @@
+#include "atomic.h"
+#include "spinlock.h"
+#include "mcslock.h"
+#include "rwlock.h"
+
+/*
+ * slow paths of the lock library. the fast paths are inline in the
+ * headers, everything that waits lives here so it stays out of line.
+ */
+
+int cpu_has_lse = 0;
+
+#define ISAR0_ATOMIC(v)     (((v) >> 20) & 0xf)     /* 2: LSE atomics */
+
+void atomic_init(void) {
+    uint64_t isar0;
+    __asm__ volatile("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+    cpu_has_lse = ISAR0_ATOMIC(isar0) >= 2;
+}
+
+#ifdef LOCK_STATS
+static inline uint64_t stat_now(void) {
+    uint64_t v;
+    __asm__ volatile("isb\n mrs %0, cntpct_el0" : "=r"(v));
+    return v;
+}
+
+#define STAT_WAIT_BEGIN()           uint64_t __wait_start = stat_now()
+#define STAT_WAIT_END(st)           do { (st).contended++;                          \
+                                         (st).wait_cycles += stat_now() - __wait_start; } while (0)
+#define STAT_ACQUIRED(st)           ((st).acquired++)
+#else
+#define STAT_WAIT_BEGIN()           do { } while (0)
+#define STAT_WAIT_END(st)           do { } while (0)
+#define STAT_ACQUIRED(st)           do { } while (0)
+#endif
+
+// spin_lock() found somebody ahead of it, sleep until owner is our ticket
+void spin_lock_wait(spinlock_t *l, uint16_t ticket) {
+    STAT_WAIT_BEGIN();
+    while (load_exclusive16(&l->owner) != ticket) {
+        cpu_wfe();
+    }
+    STAT_WAIT_END(l->stats);
+}
+
+// a consistent copy is only guaranteed while holding the lock, otherwise
+// the counters may be caught mid-update
+void lock_stats_read(const struct lock_stats *src, struct lock_stats *out) {
+    *out = *src;
+}
+
+void mcs_lock(struct mcs_lock *l, struct mcs_node *me) {
+    me->next = NULL;
+    me->locked = 0;
+
+    // the swap orders our node's init before anybody can see it
+    struct mcs_node *prev = (struct mcs_node *)atomic_xchg64((volatile uint64_t *)&l->tail,
+                                                             (uint64_t)me);
+    if (prev) {
+        STAT_WAIT_BEGIN();
+        prev->next = me;
+        while (!load_exclusive32(&me->locked)) {
+            cpu_wfe();
+        }
+        STAT_WAIT_END(l->stats);
+    }
+    STAT_ACQUIRED(l->stats);
+}
+
+int mcs_trylock(struct mcs_lock *l, struct mcs_node *me) {
+    me->next = NULL;
+    me->locked = 0;
+    if (l->tail) {
+        return 0;
+    }
+    // no acquire flavour of the 64 bit cmpxchg, the barrier follows it
+    if (atomic_cmpxchg_release64((volatile uint64_t *)&l->tail, 0, (uint64_t)me) != 0) {
+        return 0;
+    }
+    __asm__ volatile("dmb ish" ::: "memory");
+    STAT_ACQUIRED(l->stats);
+    return 1;
+}
+
+void mcs_unlock(struct mcs_lock *l, struct mcs_node *me) {
+    struct mcs_node *next = me->next;
+    if (!next) {
+        // nobody queued behind us, the lock is free again
+        if (atomic_cmpxchg_release64((volatile uint64_t *)&l->tail, (uint64_t)me, 0) == (uint64_t)me) {
+            return;
+        }
+        // a locker swapped itself in but has not linked to us yet
+        while (!(next = (struct mcs_node *)load_exclusive64((volatile uint64_t *)&me->next))) {
+            cpu_wfe();
+        }
+    }
+    store_release32(&next->locked, 1);
+}
+
+// reader counts under LOCK_STATS are approximate, readers do not exclude each other
+void read_lock(rwlock_t *l) {
+    int waited = 0;
+    STAT_WAIT_BEGIN();
+    for (;;) {
+        uint32_t v = l->cnt;
+        if (v & RW_WRITER) {
+            waited = 1;
+            if (load_exclusive32(&l->cnt) & RW_WRITER) {
+                cpu_wfe();
+            }
+            continue;
+        }
+        if (atomic_cmpxchg_acquire(&l->cnt, v, v + 1) == v) {
+            break;
+        }
+    }
+    if (waited) {
+        STAT_WAIT_END(l->stats);
+    }
+    STAT_ACQUIRED(l->stats);
+}
+
+void read_unlock(rwlock_t *l) {
+    atomic_fetch_add_release(&l->cnt, (uint32_t)-1);
+}
+
+void write_lock(rwlock_t *l) {
+    int waited = 0;
+    STAT_WAIT_BEGIN();
+    // claim the writer bit, shutting out new readers
+    for (;;) {
+        uint32_t v = l->cnt;
+        if (!(v & RW_WRITER) && atomic_cmpxchg_acquire(&l->cnt, v, v | RW_WRITER) == v) {
+            break;
+        }
+        waited = 1;
+        if (load_exclusive32(&l->cnt) & RW_WRITER) {
+            cpu_wfe();
+        }
+    }
+    // then let the readers already inside drain
+    while (load_exclusive32(&l->cnt) != RW_WRITER) {
+        waited = 1;
+        cpu_wfe();
+    }
+    if (waited) {
+        STAT_WAIT_END(l->stats);
+    }
+    STAT_ACQUIRED(l->stats);
+}
+
+void write_unlock(rwlock_t *l) {
+    store_release32(&l->cnt, 0);
+}
@@ -3,8 +3,23 @@
 #include "uart.h"
 #include "vfs.h"
 #include "string.h"
+#include "pool.h"
+#include "scratch.h"
+#include "kmalloc.h"
+#include "vma.h"
+#include "shm.h"
+#include "page_alloc.h"
+#include "klog.h"
+#include "kprintf.h"
+#include "memlayout.h"
+#include "stats.h"
 
 
+static DEFINE_POOL(message_pool, struct message_node);
+
+// MSG_COPY / MSG_MOVE transfer unit, taken from the scratch arena
+#define COPY_CHUNK 1024
+
 int queue_message(struct process *proc, struct Message *msg) {
     struct message_queue *queue = &proc->msg_queue;
     
@@ -12,19 +27,55 @@ int queue_message(struct process *proc, struct Message *msg) {
         return -1;  
     }
 
-    memcpy(&queue->messages[queue->tail], msg, sizeof(struct Message));
-    queue->tail = (queue->tail + 1) % MAX_MESSAGES;
+    struct message_node *node = pool_alloc(&message_pool);
+    if (!node) {
+        return -1;
+    }
+    memcpy(&node->msg, msg, sizeof(struct Message));
+    node->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = node;
+    } else {
+        queue->head = node;
+    }
+    queue->tail = node;
     queue->count++;
     
     
     if (proc->msg_blocked) {
         proc->msg_blocked = 0;
-        
+        if (proc->state == PROC_BLOCKED) {
+            set_process_state(proc, PROC_READY);
+        }
     }
     
     return 0;
 }
 
+// messages nobody will receive any more, the owner is being reaped
+void flush_message_queue(struct message_queue *queue) {
+    struct message_node *node = queue->head;
+    while (node) {
+        struct message_node *next = node->next;
+        pool_free(&message_pool, node);
+        node = next;
+    }
+    queue->head = queue->tail = NULL;
+    queue->count = 0;
+}
+
+// a message sent from EL0 lives in the user window, and a buffer it names
+// for the kernel to fill must lie inside the window too. kernel callers
+// pass kernel buffers
+static int user_buffer_ok(struct Message *msg, void *buf, size_t size) {
+    uint64_t m = (uint64_t)msg;
+    uint64_t b = (uint64_t)buf;
+    if (m < USER_BASE || m >= USER_END) {
+        return 1;
+    }
+    return b >= USER_BASE && b < USER_END && size <= USER_END - b;
+}
+
 int send_message(struct Message *msg) {
     switch(msg->type) {
         case MSG_OPEN: {
@@ -33,73 +84,29 @@ int send_message(struct Message *msg) {
             return fd;
         }
         case MSG_READ: {
-            uart_puts("Reading from fd: ");
-            uart_hex(msg->fd);
-            uart_puts("\n");
+            klog(KLOG_DEBUG, "Reading from fd: %d", msg->fd);
             
-            char buf[256];
-            ssize_t bytes = vfs_read(msg->fd, buf, sizeof(buf));
+            size_t mark = scratch_mark();
+            char *buf = scratch_alloc(256);
+            if (!buf) {
+                return -1;
+            }
+            ssize_t bytes = vfs_read(msg->fd, buf, 256);
             if (bytes > 0) {
                 memcpy(msg->data, buf, bytes);
                 msg->size = bytes;
             }
+            scratch_release(mark);
             return bytes;
         }
         case MSG_FORK: {
-            struct process *new = create_process();
-            if (!new) return -1;
-            
-            
-            msg->pid = new->pid;  
-            
-            
-            if (new == get_current_process()) {
-                return 0;
-            }
-            
-            
-            return 0;
+            return handle_fork_message(msg);
         }
         case MSG_EXEC: {
             return handle_exec_message(msg);
         }
         case MSG_WAIT: {
-            struct process *current = get_current_process();
-            uart_puts("Parent (PID ");
-            uart_hex(current->pid);
-            uart_puts(") waiting for children\n");
-            
-            
-            struct process *p = process_list;
-            while (p) {
-                if (p->parent_pid == current->pid && p->state == PROC_ZOMBIE) {
-                    msg->status = p->exit_status;
-                    uart_puts("Found zombie child, status: ");
-                    uart_hex(msg->status);
-                    uart_puts("\n");
-                    return 0;
-                }
-                p = p->next;
-            }
-            
-            
-            current->state = PROC_BLOCKED;
-            schedule();
-            
-            
-            p = process_list;
-            while (p) {
-                if (p->parent_pid == current->pid && p->state == PROC_ZOMBIE) {
-                    msg->status = p->exit_status;
-                    uart_puts("Child exited with status: ");
-                    uart_hex(msg->status);
-                    uart_puts("\n");
-                    return 0;
-                }
-                p = p->next;
-            }
-            
-            return -1;
+            return handle_wait_message(msg);
         }
         case MSG_PIPE: {
             
@@ -153,18 +160,27 @@ int send_message(struct Message *msg) {
                 return -1;
             }
 
-            // full path
-            char full_path[256];
+            // full path, built in the scratch arena instead of on the stack
+            size_t mark = scratch_mark();
+            char *full_path = scratch_alloc(VFS_MAX_PATH);
+            struct dirent *dirents = scratch_alloc(sizeof(struct dirent));
+            if (!full_path || !dirents) {
+                scratch_release(mark);
+                msg->status = -1;
+                return -1;
+            }
+            full_path[VFS_MAX_PATH - 1] = '\0';
             if (msg->path[0] == '/') {
-                strncpy(full_path, msg->path, sizeof(full_path) - 1);
+                strncpy(full_path, msg->path, VFS_MAX_PATH - 1);
             } else {
-                strcpy(full_path, current->cwd);
-                if (full_path[strlen(full_path) - 1] != '/') {
-                    strcat(full_path, "/");
+                strncpy(full_path, current->cwd, VFS_MAX_PATH - 1);
+                size_t len = strlen(full_path);
+                if (len && full_path[len - 1] != '/' && len < VFS_MAX_PATH - 1) {
+                    full_path[len++] = '/';
+                    full_path[len] = '\0';
                 }
-                strcat(full_path, msg->path);
+                strncpy(full_path + len, msg->path, VFS_MAX_PATH - 1 - len);
             }
-            full_path[sizeof(full_path) - 1] = '\0';
 
             // handle ..
             //uart_puts("DEBUG: Before normalization: "); uart_puts(full_path); uart_puts("\n");
@@ -172,7 +188,6 @@ int send_message(struct Message *msg) {
             //uart_puts("DEBUG: After normalization: "); uart_puts(full_path); uart_puts("\n");
 
             // if directory exists and is accessible
-            struct dirent dirents[1];
             int count = vfs_read_dir(full_path, dirents, 1);
             if (count >= 0) {
                 strncpy(current->cwd, full_path, sizeof(current->cwd) - 1);
@@ -183,6 +198,7 @@ int send_message(struct Message *msg) {
                 //uart_puts("DEBUG: Directory not accessible: "); uart_puts(full_path); uart_puts("\n");
                 msg->status = -1;
             }
+            scratch_release(mark);
             return msg->status;
         }
         case MSG_COPY: {
@@ -218,14 +234,21 @@ int send_message(struct Message *msg) {
             }
             
             // copy data in chunks
-            char buffer[1024];
+            size_t mark = scratch_mark();
+            char *buffer = scratch_alloc(COPY_CHUNK);
+            if (!buffer) {
+                vfs_close(src_fd);
+                vfs_close(dst_fd);
+                return -1;
+            }
             int bytes_read;
             int total_copied = 0;
             
-            while ((bytes_read = vfs_read(src_fd, buffer, sizeof(buffer))) > 0) {
+            while ((bytes_read = vfs_read(src_fd, buffer, COPY_CHUNK)) > 0) {
                 int bytes_written = vfs_write(dst_fd, buffer, bytes_read);
                 if (bytes_written != bytes_read) {
                     uart_puts("DEBUG: Write error during copy\n");
+                    scratch_release(mark);
                     vfs_close(src_fd);
                     vfs_close(dst_fd);
                     return -1;
@@ -233,6 +256,7 @@ int send_message(struct Message *msg) {
                 total_copied += bytes_written;
             }
             
+            scratch_release(mark);
             vfs_close(src_fd);
             vfs_close(dst_fd);
             
@@ -296,14 +320,22 @@ int send_message(struct Message *msg) {
             }
             
             // copy data
-            char buffer[1024];
+            size_t mark = scratch_mark();
+            char *buffer = scratch_alloc(COPY_CHUNK);
+            if (!buffer) {
+                vfs_close(src_fd);
+                vfs_close(dst_fd);
+                vfs_unlink(dst_path);
+                return -1;
+            }
             int bytes_read;
             int total_copied = 0;
             
-            while ((bytes_read = vfs_read(src_fd, buffer, sizeof(buffer))) > 0) {
+            while ((bytes_read = vfs_read(src_fd, buffer, COPY_CHUNK)) > 0) {
                 int bytes_written = vfs_write(dst_fd, buffer, bytes_read);
                 if (bytes_written != bytes_read) {
                     uart_puts("DEBUG: Write error during move\n");
+                    scratch_release(mark);
                     vfs_close(src_fd);
                     vfs_close(dst_fd);
                     vfs_unlink(dst_path);
@@ -312,6 +344,7 @@ int send_message(struct Message *msg) {
                 total_copied += bytes_written;
             }
             
+            scratch_release(mark);
             vfs_close(src_fd);
             vfs_close(dst_fd);
             
@@ -323,9 +356,7 @@ int send_message(struct Message *msg) {
                 return -1;
             }
             
-            uart_puts("DEBUG: Move completed, bytes moved: ");
-            uart_hex(total_copied);
-            uart_puts("\n");
+            klog(KLOG_DEBUG, "Move completed, bytes moved: %d", total_copied);
             
             return 0;
         }
@@ -363,7 +394,7 @@ int send_message(struct Message *msg) {
             return 0;
         }
         case MSG_GETC: {
-            char c = uart_getc();
+            char c = uart_getc_sleep();
             msg->character = c;
             return (int)c;
         }
@@ -371,6 +402,124 @@ int send_message(struct Message *msg) {
             uart_puts(msg->string);
             return 0;
         }
+        case MSG_MEMINFO: {
+            if (!msg->data || msg->size < sizeof(struct kmem_info) ||
+                !user_buffer_ok(msg, msg->data, sizeof(struct kmem_info))) {
+                return -1;
+            }
+            kmem_get_info((struct kmem_info *)msg->data);
+            msg->size = sizeof(struct kmem_info);
+            return 0;
+        }
+        case MSG_BRK: {
+            struct process *current = get_current_process();
+            if (!current || !current->mm.pgd) {
+                return -1;
+            }
+            uint64_t want = (uint64_t)msg->data;
+            uint64_t now = vma_brk(&current->mm, want);
+            msg->data = (void *)now;
+            return (want && now != want) ? -1 : 0;
+        }
+        case MSG_SHM_CREATE: {
+            struct process *current = get_current_process();
+            if (!current) {
+                return -1;
+            }
+            struct shm_object *obj = shm_create(msg->size);
+            if (!obj) {
+                return -1;
+            }
+            uint64_t addr = shm_map(obj, current, 0);
+            if (!addr) {
+                return -1;
+            }
+            msg->fd = obj->id;
+            msg->data = (void *)addr;
+            return 0;
+        }
+        case MSG_SHM_GRANT: {
+            // only a process that has the object mapped may hand it on,
+            // and never with more access than it has itself
+            struct process *current = get_current_process();
+            struct process *peer = find_process(msg->pid);
+            struct shm_object *obj = shm_lookup(msg->fd);
+            if (!current || !peer || !obj || !shm_is_mapped(obj, current)) {
+                return -1;
+            }
+            int rdonly = (msg->flags & SHM_RDONLY) || !shm_is_writable(obj, current);
+            uint64_t addr = shm_map(obj, peer, rdonly);
+            if (!addr) {
+                return -1;
+            }
+
+            // tell the peer where it landed
+            struct Message note = {0};
+            note.type = MSG_SHM_GRANT;
+            note.fd = obj->id;
+            note.pid = current->pid;
+            note.data = (void *)addr;
+            note.size = obj->npages << PAGE_SHIFT;
+            note.flags = rdonly ? SHM_RDONLY : 0;
+            if (queue_message(peer, &note) < 0) {
+                shm_unmap(peer, addr);
+                return -1;
+            }
+            return 0;
+        }
+        case MSG_SHM_UNMAP: {
+            struct process *current = get_current_process();
+            if (!current) {
+                return -1;
+            }
+            return shm_unmap(current, (uint64_t)msg->data);
+        }
+        case MSG_MMAP: {
+            struct process *current = get_current_process();
+            void *data;
+            size_t size;
+            if (!current || !current->mm.pgd || vfs_map(msg->path, &data, &size) < 0) {
+                return -1;
+            }
+            uint64_t addr = vma_map_file(&current->mm, data, size, msg->flags);
+            if (!addr) {
+                vfs_map_put(data);
+                return -1;
+            }
+            msg->data = (void *)addr;
+            msg->size = size;
+            return 0;
+        }
+        case MSG_KLOG: {
+            if (!msg->data || !msg->size || !user_buffer_ok(msg, msg->data, msg->size)) {
+                return -1;
+            }
+            msg->size = klog_dump(msg->data, msg->size);
+            return 0;
+        }
+        case MSG_STATS: {
+            if (!msg->data || !msg->size || !user_buffer_ok(msg, msg->data, msg->size)) {
+                return -1;
+            }
+            msg->size = stats_report(msg->flags, msg->data, msg->size);
+            return 0;
+        }
+        case MSG_KLOG_LEVEL: {
+            msg->status = klog_set_level(msg->flags);
+            return 0;
+        }
+        case MSG_MUNMAP: {
+            struct process *current = get_current_process();
+            if (!current) {
+                return -1;
+            }
+            struct vma *v = vma_find(&current->mm, (uint64_t)msg->data);
+            if (!v || !(v->flags & VMA_FILE) || v->start != (uint64_t)msg->data) {
+                return -1;
+            }
+            vma_unmap(&current->mm, v);
+            return 0;
+        }
         default:
             return -1;
     }
@@ -384,6 +533,7 @@ int receive_message(struct Message *msg) {
         
         if (!(msg->flags & MSG_NONBLOCK)) {
             current->msg_blocked = 1;
+            set_process_state(current, PROC_BLOCKED);
             
             schedule();  
         }
@@ -391,9 +541,14 @@ int receive_message(struct Message *msg) {
     }
     
     
-    memcpy(msg, &queue->messages[queue->head], sizeof(struct Message));
-    queue->head = (queue->head + 1) % MAX_MESSAGES;
+    struct message_node *node = queue->head;
+    memcpy(msg, &node->msg, sizeof(struct Message));
+    queue->head = node->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
     queue->count--;
+    pool_free(&message_pool, node);
     
     return 0;
 }
@@ -418,10 +573,20 @@ int handle_message(struct Message *msg) {
             return send_message(msg);
         case MSG_PUTS:
             return send_message(msg);
+        case MSG_MEMINFO:
+            return send_message(msg);
+        case MSG_BRK:
+            return send_message(msg);
+        case MSG_SHM_CREATE:
+        case MSG_SHM_GRANT:
+        case MSG_SHM_UNMAP:
+        case MSG_MMAP:
+        case MSG_MUNMAP:
+        case MSG_KLOG:
+        case MSG_KLOG_LEVEL:
+            return send_message(msg);
         default:
-            uart_puts("Unknown message type: ");
-            uart_hex(msg->type);
-            uart_puts("\n");
+            kprintf("Unknown message type: %lu\n", msg->type);
             return -1;
     }
 }
\ No newline at end of file
@@ -1,14 +1,17 @@
 #include "namespace.h"
 #include "uart.h"
 #include "kmalloc.h"
+#include "pool.h"
 #include "string.h"
 #include "process.h"
 #include "vfs.h"
 
 static struct namespace *mounts = NULL;  
 
+static DEFINE_POOL(namespace_pool, struct namespace);
+
 struct namespace* create_namespace(const char *old, const char *new, int flags) {
-    struct namespace *ns = kalloc(sizeof(struct namespace));
+    struct namespace *ns = pool_alloc(&namespace_pool);
     if (!ns) {
         uart_puts("Failed to allocate namespace\n");
         return NULL;
@@ -17,12 +20,14 @@ struct namespace* create_namespace(const char *old, const char *new, int flags)
     size_t old_len = strlen(old) + 1;
     size_t new_len = strlen(new) + 1;
     
-    ns->old_path = kalloc(old_len);
-    ns->new_path = kalloc(new_len);
+    ns->old_path = kalloc_tag(old_len, KMEM_NAMESPACE);
+    ns->new_path = kalloc_tag(new_len, KMEM_NAMESPACE);
     
     if (!ns->old_path || !ns->new_path) {
         uart_puts("Failed to allocate namespace paths\n");
-        kfree(ns);
+        kfree(ns->old_path);
+        kfree(ns->new_path);
+        pool_free(&namespace_pool, ns);
         return NULL;
     }
     
@@ -39,6 +44,19 @@ void init_process_namespace(struct proc_namespace *ns) {
     ns->mounts = NULL;
 }
 
+// the process is gone, drop all of its mounts
+void free_process_namespace(struct proc_namespace *ns) {
+    struct namespace *entry = ns->mounts;
+    while (entry) {
+        struct namespace *next = entry->next;
+        kfree(entry->old_path);
+        kfree(entry->new_path);
+        pool_free(&namespace_pool, entry);
+        entry = next;
+    }
+    ns->mounts = NULL;
+}
+
 int bind(const char *old, const char *new, int flags) {
     uart_puts("Binding ");
     uart_puts(new);
@@ -107,7 +125,7 @@ int unbind(const char *path) {
             }
             kfree(entry->old_path);
             kfree(entry->new_path);
-            kfree(entry);
+            pool_free(&namespace_pool, entry);
             uart_puts("Successfully unbound namespace\n");
             return 0;
         }
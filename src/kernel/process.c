@@ -4,137 +4,810 @@
 #include "namespace.h"
 #include "string.h"    
 #include "kmalloc.h"   
+#include "page_alloc.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "vma.h"
+#include "cache.h"
 #include "timer.h"
 #include "gic.h"
+#include "fpsimd.h"
+#include "klog.h"
+#include "kprintf.h"
+#include "scratch.h"
 
-#define MAX_PROCESSES    4
 #define PROCESS_STACK_SIZE 4096
 
-static process_t processes[MAX_PROCESSES];
-static int process_count = 0;
-static uint8_t process_stacks[MAX_PROCESSES][PROCESS_STACK_SIZE];
+/*
+ * one run queue per CPU: a FIFO per priority plus a bitmap of the
+ * non-empty ones. priority p is bit 31 - p, so clz of the bitmap is the
+ * most urgent priority with a runnable process and picking the next one
+ * never looks at anybody else. only PROC_READY processes are queued, the
+ * running one is not, and a process is always queued on p->cpu.
+ * queues change only under the kernel lock, any CPU may peek at the
+ * bitmap and count without it.
+ *
+ * balancing is pull based. a CPU that runs out of work steals the
+ * newest entry of the busiest queue in schedule(), a CPU with waiters
+ * asks a lighter one to pull every SCHED_BALANCE_TICKS, and a wakeup
+ * goes to an idle CPU rather than queueing behind a running process.
+ */
+struct run_queue {
+    struct {
+        process_t *head;
+        process_t *tail;
+    } queue[NR_PRIORITIES];
+    volatile uint32_t bitmap;
+    volatile int nr_queued;
+    int need_resched;
+    volatile int need_balance;  /* asked to pull from a busier CPU */
+    int slice_armed;            /* the running process is paying for its slice */
+    uint64_t next_balance;      /* counter value of the next balancer run */
+    process_t idle;             /* runs when nothing is queued, never queued itself */
+    struct idle_stats idle_stats;
+    struct sched_stats stats;
+};
 
-static process_t *ready_queue = NULL;
+static struct run_queue run_queues[NR_CPUS];
+
+#define cpu_rq(cpu)     (&run_queues[(cpu)])
+#define this_rq()       cpu_rq(smp_processor_id())
 
-process_t *current_process = NULL;
 struct process *process_list = NULL;  
 
 static int next_pid = 2;  
 
+/*
+ * every process that still has a pid, zombies included, hashed by pid.
+ * pids are handed out in order, so the low bits spread them evenly. the
+ * table doubles once it holds more processes than buckets, and if that
+ * allocation fails the chains just get longer
+ */
+static struct process *pid_hash_initial[PID_HASH_MIN];
+static struct process **pid_hash = pid_hash_initial;
+static unsigned int pid_hash_size = PID_HASH_MIN;
+static unsigned int nr_processes = 0;
+
+/* exited with no parent to wait for them, reaped by reap_orphans() */
+static struct process *orphans = NULL;
+
+static unsigned int sched_slice = SCHED_SLICE_TICKS;
+
+extern void ret_from_fork(void);
+
 typedef unsigned long uint64_t;
 
-void uart_hex(unsigned long h);
+
+// stacks come from the page allocator, returns the initial (top) sp or 0
+static unsigned long alloc_process_stack(struct process *p) {
+    if (!p->stack) {
+        p->stack = page_alloc(get_order(PROCESS_STACK_SIZE));
+        if (!p->stack) {
+            uart_puts("Failed to allocate process stack\n");
+            return 0;
+        }
+    }
+    return (unsigned long)p->stack + PROCESS_STACK_SIZE;
+}
+
+// kernel stack with room for the user trap frame at its top
+static int alloc_kstack(struct process *p) {
+    if (!p->kstack) {
+        p->kstack = page_alloc(get_order(KSTACK_SIZE));
+        if (!p->kstack) {
+            uart_puts("Failed to allocate kernel stack\n");
+            return -1;
+        }
+    }
+    p->tf = (struct trap_frame *)((char *)p->kstack + KSTACK_SIZE) - 1;
+    return 0;
+}
+
+#define pid_bucket(pid, size)   ((unsigned int)(pid) & ((size) - 1))
+
+static void pid_hash_grow(void) {
+    unsigned int size = pid_hash_size * 2;
+    struct process **table = kalloc_tag(size * sizeof(*table), KMEM_PROCESS);
+    if (!table) {
+        return;
+    }
+    for (unsigned int i = 0; i < pid_hash_size; i++) {
+        struct process *p = pid_hash[i];
+        while (p) {
+            struct process *next = p->hash_next;
+            unsigned int b = pid_bucket(p->pid, size);
+            p->hash_next = table[b];
+            table[b] = p;
+            p = next;
+        }
+    }
+    if (pid_hash != pid_hash_initial) {
+        kfree(pid_hash);
+    }
+    pid_hash = table;
+    pid_hash_size = size;
+}
+
+static void pid_hash_remove(struct process *p) {
+    struct process **link = &pid_hash[pid_bucket(p->pid, pid_hash_size)];
+    while (*link) {
+        if (*link == p) {
+            *link = p->hash_next;
+            p->hash_next = NULL;
+            return;
+        }
+        link = &(*link)->hash_next;
+    }
+}
+
+static void sibling_push(struct process **head, struct process *p) {
+    p->sibling = *head;
+    if (*head) {
+        (*head)->sibling_pprev = &p->sibling;
+    }
+    *head = p;
+    p->sibling_pprev = head;
+}
+
+static void sibling_unlink(struct process *p) {
+    if (!p->sibling_pprev) {
+        return;
+    }
+    *p->sibling_pprev = p->sibling;
+    if (p->sibling) {
+        p->sibling->sibling_pprev = p->sibling_pprev;
+    }
+    p->sibling = NULL;
+    p->sibling_pprev = NULL;
+}
+
+// zeroed process with its own namespace and "/" as cwd, not yet visible
+static struct process *alloc_process(void) {
+    struct process *p = kalloc_tag(sizeof(struct process), KMEM_PROCESS);
+    if (!p) {
+        uart_puts("Failed to allocate process\n");
+        return NULL;
+    }
+    init_process_namespace(&p->ns);
+    p->fpsimd_cpu = -1;
+    p->scratch_mark = SCRATCH_NO_MARK;
+    p->cwd[0] = '/';
+    p->cwd[1] = '\0';
+    return p;
+}
+
+// everything a process owns, the struct itself included. p must be
+// unreachable and not running anywhere
+static void free_process(struct process *p) {
+    fpsimd_release(p);
+    if (p->mm.pgd) {
+        vma_free_all(&p->mm);
+        mmu_free_address_space(&p->mm);
+        p->ctx.ttbr0 = 0;
+    }
+    if (p->stack) {
+        page_free(p->stack);
+    }
+    if (p->kstack) {
+        page_free(p->kstack);
+    }
+    free_process_namespace(&p->ns);
+    flush_message_queue(&p->msg_queue);
+    kfree(p);
+}
+
+// makes p findable by pid and, with a parent, waitable
+static void publish_process(struct process *p, struct process *parent) {
+    if (nr_processes >= pid_hash_size) {
+        pid_hash_grow();
+    }
+    unsigned int b = pid_bucket(p->pid, pid_hash_size);
+    p->hash_next = pid_hash[b];
+    pid_hash[b] = p;
+
+    p->prev = NULL;
+    p->next = process_list;
+    if (process_list) {
+        process_list->prev = p;
+    }
+    process_list = p;
+
+    p->parent = parent;
+    p->parent_pid = parent ? parent->pid : 0;
+    if (parent) {
+        sibling_push(&parent->children, p);
+    }
+    nr_processes++;
+}
+
+// first switch to p returns straight to EL0 through its trap frame,
+// via schedule_tail() to drop the kernel lock schedule() handed over
+static void setup_ret_to_user(struct process *p) {
+    p->ctx.sp = (unsigned long)p->tf;
+    p->ctx.fp = 0;
+    p->ctx.lr = (unsigned long)ret_from_fork;
+    p->ctx.daif = DAIF_MASKED;
+}
+
+int process_start_user(struct process *p, unsigned long pc, unsigned long sp) {
+    if (alloc_kstack(p) < 0) {
+        return -1;
+    }
+    memset(p->tf, 0, sizeof(*p->tf));
+    p->tf->elr = pc;
+    p->tf->sp_el0 = sp;
+    p->tf->spsr = SPSR_EL0T;
+    setup_ret_to_user(p);
+    return 0;
+}
+
+// IRQs stay masked here, wfi still wakes for a pending one which is then
+// taken in the short window with them unmasked. the kernel lock is only
+// taken to switch away
+static int steal_candidate(void);
+
+static void idle_loop(void) {
+    struct run_queue *rq = this_rq();
+    for (;;) {
+        if (rq->bitmap || rq->need_balance || steal_candidate() || klog_need_drain()) {
+            kernel_lock();
+            schedule();
+            kernel_unlock();
+            continue;
+        }
+        uint64_t start = timer_now();
+        asm volatile("dsb sy\n wfi");
+        rq->idle_stats.idle_cycles += timer_now() - start;
+        rq->idle_stats.wakeups++;
+        asm volatile("msr daifclr, #2\n isb\n msr daifset, #2" ::: "memory");
+    }
+}
+
+// the first switch to an idle task comes from schedule(), lock held
+static void idle_entry(void) {
+    kernel_unlock();
+    idle_loop();
+}
+
+// sets up the idle task of cpu, returns the top of its stack or 0
+unsigned long sched_init_cpu(int cpu) {
+    process_t *idle = &cpu_rq(cpu)->idle;
+    if (alloc_kstack(idle) < 0) {
+        return 0;
+    }
+    idle->pid = 0;
+    idle->cpu = cpu;
+    idle->priority = NR_PRIORITIES - 1;
+    idle->state = PROC_READY;
+    idle->ctx.sp = (unsigned long)idle->kstack + KSTACK_SIZE;
+    idle->ctx.lr = (unsigned long)idle_entry;
+    idle->ctx.daif = DAIF_MASKED;
+    return idle->ctx.sp;
+}
+
+// a secondary CPU turns into its idle task, already on the idle stack
+void sched_start_cpu(void) {
+    struct run_queue *rq = this_rq();
+    rq->idle.state = PROC_RUNNING;
+    current_process = &rq->idle;
+    idle_loop();
+}
+
+// dropped by every process the first time it runs
+void schedule_tail(void) {
+    kernel_unlock();
+}
 
 void process_init(void) {
     uart_puts("Initializing process management...\n");
-    process_count = 0;
+    nr_processes = 0;
     current_process = NULL;
-    ready_queue = NULL;
+    memset(run_queues, 0, sizeof(run_queues));
+    sched_init_cpu(smp_processor_id());
+}
+
+static uint64_t slice_deadline(void) {
+    return timer_now() + (uint64_t)sched_slice * timer_tick_cycles();
 }
 
+static uint64_t balance_deadline(void) {
+    return timer_now() + (uint64_t)SCHED_BALANCE_TICKS * timer_tick_cycles();
+}
+
+// one-shot deadline for the end of the running slice, only needed while
+// somebody else is waiting for the CPU. nothing is charged while a
+// process runs alone, its slice starts when the first waiter shows up.
+// always on the CPU that owns the queue
+static void sched_arm_timer(void) {
+    struct run_queue *rq = this_rq();
+    process_t *p = current_process;
+    if (!p || p == &rq->idle || p->state != PROC_RUNNING || !rq->bitmap) {
+        timer_stop();
+        rq->slice_armed = 0;
+        return;
+    }
+    if (!rq->slice_armed) {
+        p->slice_end = slice_deadline();
+        rq->next_balance = balance_deadline();
+        rq->slice_armed = 1;
+    }
+    uint64_t deadline = p->slice_end;
+    if (smp_num_cpus() > 1 && rq->next_balance < deadline) {
+        deadline = rq->next_balance;
+    }
+    timer_set_deadline(deadline);
+}
+
+static void rq_enqueue(process_t *p) {
+    if (p->on_rq) {
+        return;
+    }
+    struct run_queue *rq = cpu_rq(p->cpu);
+    int prio = p->priority;
+    p->rq_next = NULL;
+    p->rq_prev = rq->queue[prio].tail;
+    if (rq->queue[prio].tail) {
+        rq->queue[prio].tail->rq_next = p;
+    } else {
+        rq->queue[prio].head = p;
+    }
+    rq->queue[prio].tail = p;
+    rq->bitmap |= 1U << (31 - prio);
+    rq->nr_queued++;
+    p->on_rq = 1;
+}
+
+static void rq_dequeue(process_t *p) {
+    if (!p->on_rq) {
+        return;
+    }
+    struct run_queue *rq = cpu_rq(p->cpu);
+    int prio = p->priority;
+    if (p->rq_prev) {
+        p->rq_prev->rq_next = p->rq_next;
+    } else {
+        rq->queue[prio].head = p->rq_next;
+    }
+    if (p->rq_next) {
+        p->rq_next->rq_prev = p->rq_prev;
+    } else {
+        rq->queue[prio].tail = p->rq_prev;
+    }
+    if (!rq->queue[prio].head) {
+        rq->bitmap &= ~(1U << (31 - prio));
+    }
+    rq->nr_queued--;
+    p->rq_next = NULL;
+    p->rq_prev = NULL;
+    p->on_rq = 0;
+}
+
+// head of the most urgent non-empty queue, taken off it
+static process_t *rq_pick(struct run_queue *rq) {
+    if (!rq->bitmap) {
+        return NULL;
+    }
+    process_t *p = rq->queue[__builtin_clz(rq->bitmap)].head;
+    rq_dequeue(p);
+    return p;
+}
+
+static int cpu_is_idle(int cpu) {
+    return cpus[cpu].online && cpus[cpu].current == &cpu_rq(cpu)->idle &&
+           !cpu_rq(cpu)->nr_queued;
+}
+
+// a woken process would wait behind whatever runs on its CPU, an idle
+// CPU takes it instead
+static void select_wake_cpu(process_t *p) {
+    if (smp_num_cpus() < 2 || cpu_is_idle(p->cpu)) {
+        return;
+    }
+    for (int i = 0; i < NR_CPUS; i++) {
+        if (i != p->cpu && cpu_is_idle(i)) {
+            p->cpu = i;
+            cpu_rq(i)->stats.migrations++;
+            return;
+        }
+    }
+}
+
+// newest entry of the most urgent queue, the owner takes from the head
+static process_t *rq_steal(struct run_queue *victim) {
+    if (!victim->bitmap) {
+        return NULL;
+    }
+    process_t *p = victim->queue[__builtin_clz(victim->bitmap)].tail;
+    rq_dequeue(p);
+    return p;
+}
+
+// pull one process from the busiest queue when it has two more waiting
+// than we do, or anything at all while we have nothing. kernel lock held
+static void sched_pull(struct run_queue *rq) {
+    int self = smp_processor_id();
+    int busiest = -1;
+    int most = 0;
+
+    rq->need_balance = 0;
+    for (int i = 0; i < NR_CPUS; i++) {
+        if (i == self || !cpus[i].online) {
+            continue;
+        }
+        if (cpu_rq(i)->nr_queued > most) {
+            busiest = i;
+            most = cpu_rq(i)->nr_queued;
+        }
+    }
+    if (busiest < 0 || (rq->nr_queued && most < rq->nr_queued + 2)) {
+        return;
+    }
+
+    int was_empty = !rq->nr_queued;
+    process_t *p = rq_steal(cpu_rq(busiest));
+    if (!p) {
+        return;
+    }
+    p->cpu = self;
+    rq_enqueue(p);
+    rq->stats.migrations++;
+    if (was_empty) {
+        rq->stats.steals++;
+    }
+}
+
+// lock-free look at the other queues from the idle loop
+static int steal_candidate(void) {
+    int self = smp_processor_id();
+    for (int i = 0; i < NR_CPUS; i++) {
+        if (i != self && cpus[i].online && cpu_rq(i)->nr_queued) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// balancer tick on a CPU with waiters: the lightest other CPU, if it is
+// lighter by two or more, is asked to pull. IRQ context, no kernel lock
+static void sched_balance_kick(struct run_queue *rq) {
+    int self = smp_processor_id();
+    int load = rq->nr_queued + 1;
+    int target = -1;
+    int least = load - 1;
+
+    for (int i = 0; i < NR_CPUS; i++) {
+        if (i == self || !cpus[i].online) {
+            continue;
+        }
+        struct run_queue *other = cpu_rq(i);
+        int l = other->nr_queued + (cpus[i].current != &other->idle);
+        if (l < least) {
+            target = i;
+            least = l;
+        }
+    }
+    if (target < 0) {
+        return;
+    }
+    cpu_rq(target)->need_balance = 1;
+    smp_send_reschedule(target);
+    rq->stats.balance_kicks++;
+}
+
+void set_process_state(struct process *p, enum process_state state) {
+    if (state == PROC_READY && !p->on_rq && p != current_process) {
+        select_wake_cpu(p);
+    }
+    if (state == PROC_READY) {
+        rq_enqueue(p);
+    } else {
+        rq_dequeue(p);
+    }
+    p->state = state;
+    // a new waiter: the owning CPU starts charging its running process
+    if (state == PROC_READY && p != current_process) {
+        if (p->cpu == smp_processor_id()) {
+            sched_arm_timer();
+        } else {
+            smp_send_reschedule(p->cpu);
+        }
+    }
+}
+
+static void wait_queue_remove(struct wait_queue *wq, struct process *p) {
+    struct process *prev = NULL;
+    for (struct process *q = wq->head; q; prev = q, q = q->wait_next) {
+        if (q != p) {
+            continue;
+        }
+        if (prev) {
+            prev->wait_next = p->wait_next;
+        } else {
+            wq->head = p->wait_next;
+        }
+        if (wq->tail == p) {
+            wq->tail = prev;
+        }
+        break;
+    }
+    p->wait_next = NULL;
+    p->wait_on = NULL;
+}
+
+// the idle task and the boot context have nowhere to go, for them this
+// returns at once and the caller's wait_event() loop polls
+void sleep_on(struct wait_queue *wq) {
+    struct process *p = current_process;
+    if (!p || p == &this_rq()->idle) {
+        return;
+    }
+    if (scratch_held(p->scratch_mark)) {
+        kprintf("scratch: pid %d sleeps holding scratch buffers\n", p->pid);
+    }
+    p->wait_next = NULL;
+    p->wait_on = wq;
+    if (wq->tail) {
+        wq->tail->wait_next = p;
+    } else {
+        wq->head = p;
+    }
+    wq->tail = p;
+
+    set_process_state(p, PROC_BLOCKED);
+    schedule();
+
+    // woken some other way, still queued
+    if (p->wait_on) {
+        wait_queue_remove(p->wait_on, p);
+    }
+}
+
+int wake_up_one(struct wait_queue *wq) {
+    struct process *p = wq->head;
+    if (!p) {
+        return 0;
+    }
+    wq->head = p->wait_next;
+    if (!wq->head) {
+        wq->tail = NULL;
+    }
+    p->wait_next = NULL;
+    p->wait_on = NULL;
+    if (p->state == PROC_BLOCKED) {
+        set_process_state(p, PROC_READY);
+    }
+    return 1;
+}
+
+int wake_up_all(struct wait_queue *wq) {
+    int n = 0;
+    while (wake_up_one(wq)) {
+        n++;
+    }
+    return n;
+}
+
+// IPI_RESCHEDULE, another CPU queued something here or wants us to pull
+void sched_ipi(void) {
+    struct run_queue *rq = this_rq();
+    if (rq->need_balance) {
+        rq->need_resched = 1;
+    }
+    sched_arm_timer();
+}
 
+// least loaded online CPU for a new process, counting what runs there
+int sched_pick_cpu(void) {
+    int best = smp_processor_id();
+    int best_load = -1;
+    for (int i = 0; i < NR_CPUS; i++) {
+        if (!cpus[i].online) {
+            continue;
+        }
+        struct run_queue *rq = cpu_rq(i);
+        int load = rq->nr_queued + (cpus[i].current && cpus[i].current != &rq->idle);
+        if (best_load < 0 || load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// a top level process, nobody waits for it and it is reaped on exit
 process_t* process_create(void (*entry)(void)) {
-    process_t *proc = kalloc(sizeof(process_t));
+    process_t *proc = alloc_process();
     if (!proc) {
-        uart_puts("Failed to allocate process\n");
         return NULL;
     }
-    
-    init_process_namespace(&proc->ns);
+
+    if (alloc_kstack(proc) < 0) {
+        free_process(proc);
+        return NULL;
+    }
+    if (mmu_new_address_space(&proc->mm) < 0) {
+        uart_puts("Failed to allocate address space\n");
+        free_process(proc);
+        return NULL;
+    }
     
     if (!current_process) {
         current_process = proc;
     }
 
-    
-    if (!process_list) {
-        process_list = proc;
-    } else {
-        proc->next = process_list;
-        process_list = proc;
-    }
-
     proc->ctx.pc = (unsigned long)entry;
     proc->pid = next_pid++;
-
-    // init current working directory to root
-    proc->cwd[0] = '/';
-    proc->cwd[1] = '\0';
+    proc->priority = PRIO_DEFAULT;
+    proc->cpu = sched_pick_cpu();
+    publish_process(proc, NULL);
 
     return proc;
 }
 
+// first switch to a kernel thread, lock handed over by schedule()
+static void kthread_start(void) {
+    void (*fn)(void) = (void (*)(void))current_process->ctx.pc;
+    kernel_unlock();
+    fn();
+    kernel_lock();
+    process_exit(0);
+}
+
+// fn runs at EL1 on the kernel's address space with IRQs masked, without
+// the kernel lock. it is never preempted and runs until it blocks
+process_t* kthread_create(void (*fn)(void)) {
+    process_t *p = alloc_process();
+    if (!p) {
+        return NULL;
+    }
+    if (alloc_kstack(p) < 0) {
+        free_process(p);
+        return NULL;
+    }
+    p->ctx.pc = (unsigned long)fn;
+    p->ctx.sp = (unsigned long)p->tf;
+    p->ctx.lr = (unsigned long)kthread_start;
+    p->ctx.daif = DAIF_MASKED;
+    p->pid = next_pid++;
+    p->priority = PRIO_DEFAULT;
+    p->cpu = sched_pick_cpu();
+    publish_process(p, NULL);
+    set_process_state(p, PROC_READY);
+    return p;
+}
+
 extern void switch_context(context_t *old_ctx, context_t *new_ctx);
 
 void schedule(void) {
+    struct run_queue *rq = this_rq();
     struct process *current = get_current_process();
-    struct process *next = NULL;
-    
-    
-    for (next = process_list; next; next = next->next) {
-        
-        if (next->state == PROC_ZOMBIE) {
-            continue;
-        }
-        
-        if (next->state == PROC_READY) {
-            // uart_puts("Schedule: switching from PID ");
-            // uart_hex(current->pid);
-            // uart_puts(" to PID ");
-            // uart_hex(next->pid);
-            // uart_puts("\n");
-            
-            next->state = PROC_RUNNING;
-            if (current && current->state == PROC_RUNNING) {
-                current->state = PROC_READY;
-            }
 
-            struct process *old = current_process;
-            current_process = next;
-            
-            if (old) {
-                context_switch(&old->ctx, &next->ctx);
-            } else {
-                context_switch(NULL, &next->ctx);
-            }
-            return;
-        }
+    klog_poke();
+
+    // a running process that is merely giving up the CPU goes to the back of its queue
+    if (current && current != &rq->idle && current->state == PROC_RUNNING) {
+        set_process_state(current, PROC_READY);
+    }
+    if (smp_num_cpus() > 1) {
+        sched_pull(rq);
+    }
+
+    struct process *next = rq_pick(rq);
+    if (!next) {
+        next = &rq->idle;
+    }
+    next->state = PROC_RUNNING;
+    rq->need_resched = 0;
+    rq->slice_armed = 0;
+    if (next == current) {
+        sched_arm_timer();
+        return;
+    }
+    if (next == &rq->idle) {
+        rq->idle_stats.entries++;
+    }
+
+    // uart_puts("Schedule: switching from PID ");
+    // uart_hex(current->pid);
+    // uart_puts(" to PID ");
+    // uart_hex(next->pid);
+    // uart_puts("\n");
+
+    struct process *old = current_process;
+    current_process = next;
+    // the idle task has no mm of its own and runs on the empty TTBR0
+    next->ctx.ttbr0 = mmu_activate(&next->mm);
+    sched_arm_timer();
+    fpsimd_switch(old, next);
+
+    if (old) {
+        context_switch(&old->ctx, &next->ctx);
+    } else {
+        context_switch(NULL, &next->ctx);
+    }
+}
+
+// slice deadline hit, the running process loses the CPU on its way back to EL0.
+// an early or stale expiry just arms the timer again
+void sched_tick(void) {
+    struct run_queue *rq = this_rq();
+    struct process *p = current_process;
+    if (rq->slice_armed && rq->nr_queued && timer_now() >= rq->next_balance) {
+        rq->next_balance = balance_deadline();
+        sched_balance_kick(rq);
+    }
+    if (rq->slice_armed && p && p != &rq->idle && p->state == PROC_RUNNING &&
+        timer_now() >= p->slice_end) {
+        rq->need_resched = 1;
+        return;
+    }
+    sched_arm_timer();
+}
+
+void sched_idle_stats(int cpu, struct idle_stats *out) {
+    *out = cpu_rq(cpu)->idle_stats;
+}
+
+void sched_cpu_stats(int cpu, struct sched_stats *out) {
+    *out = cpu_rq(cpu)->stats;
+}
+
+int sched_need_resched(void) {
+    return this_rq()->need_resched;
+}
+
+void sched_set_slice(unsigned int ticks) {
+    sched_slice = ticks ? ticks : 1;
+}
+
+// reaps exited processes that had no parent. any of them is off its CPU
+// by the time somebody else holds the kernel lock
+static void reap_orphans(void) {
+    while (orphans) {
+        reap_process(orphans);
+    }
+}
+
+// children of an exiting process: zombies go now, live ones are orphaned
+static void release_children(struct process *p) {
+    while (p->zombies) {
+        reap_process(p->zombies);
+    }
+    while (p->children) {
+        struct process *c = p->children;
+        sibling_unlink(c);
+        c->parent = NULL;
+        c->parent_pid = 0;
     }
-    
-    
-    uart_puts("No ready processes to run\n");
-    while(1); 
 }
 
 void process_exit(int status) {
-    if (!current_process) return;
-    
-    uart_puts("Process ");
-    uart_hex(current_process->pid);
-    uart_puts(" exiting with status: ");
-    uart_hex(status);
-    uart_puts("\n");
-    
-    current_process->state = PROC_ZOMBIE;
-    current_process->exit_status = status;
+    struct process *p = current_process;
+    if (!p) return;
     
+    kprintf("Process %d exiting with status: %d\n", p->pid, status);
     
-    process_t *prev = NULL;
-    process_t *temp = ready_queue;
-    while (temp) {
-        if (temp == current_process) {
-            if (prev) {
-                prev->next = temp->next;
-            } else {
-                ready_queue = temp->next;
+    reap_orphans();
+    release_children(p);
+
+    set_process_state(p, PROC_ZOMBIE);
+    p->exit_status = status;
+
+    // the parent finds it on its zombie list, waking it if it waits
+    sibling_unlink(p);
+    struct process *parent = p->parent;
+    if (parent) {
+        sibling_push(&parent->zombies, p);
+        if (parent->wait_blocked) {
+            parent->wait_blocked = 0;
+            if (parent->state == PROC_BLOCKED) {
+                set_process_state(parent, PROC_READY);
             }
-            break;
         }
-        prev = temp;
-        temp = temp->next;
+    } else {
+        sibling_push(&orphans, p);
     }
     
-    
     current_process = NULL;
     
     schedule();  
@@ -147,21 +820,23 @@ int execve(const char *path, char *const argv[], char *const envp[]);
 
 void init_process(void) {
     
-    struct process *init = &processes[0];
+    struct process *init = alloc_process();
+    if (!init) {
+        return;
+    }
     init->pid = 1;  
-    init->parent_pid = 0;  
     init->state = PROC_RUNNING;
-    init->next = NULL;
+    init->priority = PRIO_DEFAULT;
     
     
-    init->sp = (unsigned long)&process_stacks[0][PROCESS_STACK_SIZE];
+    init->sp = alloc_process_stack(init);
     init->ctx.sp = init->sp;
     init->ctx.lr = 0;  
+    init->mm = *mmu_kernel_mm();
     
     
-    process_list = init;
+    publish_process(init, NULL);
     current_process = init;
-    process_count = 1;
     next_pid = 2;  
     
     uart_puts("Process management initialized\n");
@@ -176,22 +851,41 @@ pid_t get_pid(struct process *p) {
 }
 
 
+// child of the current process, the table only grows as memory allows
 struct process* create_process(void) {
     struct process *current = get_current_process();
-    struct process *new = &processes[process_count++];
+    reap_orphans();
+    struct process *new = alloc_process();
+    if (!new) {
+        return NULL;
+    }
+    new->sp = alloc_process_stack(new);
+    if (!new->sp || alloc_kstack(new) < 0) {
+        free_process(new);
+        return NULL;
+    }
+
+    // the child shares the parent's user pages copy-on-write
+    if (mmu_new_address_space(&new->mm) < 0) {
+        free_process(new);
+        return NULL;
+    }
+    if (current->mm.pgd && (mmu_share_user(&new->mm, &current->mm) < 0 ||
+                            vma_copy(&new->mm, &current->mm) < 0)) {
+        uart_puts("Failed to copy address space\n");
+        free_process(new);
+        return NULL;
+    }
     
-    uart_puts("Creating process with PID: ");
-    uart_hex(next_pid);
-    uart_puts("\n");
+    kprintf("Creating process with PID: %d\n", next_pid);
     
     new->pid = next_pid++;
-    new->parent_pid = current->pid;
-    new->state = PROC_READY;
-    new->next = process_list;
-    process_list = new;
+    new->priority = current->priority;
+    new->cpu = sched_pick_cpu();
+    publish_process(new, current);
+    set_process_state(new, PROC_READY);
     
     
-    new->sp = (unsigned long)&process_stacks[process_count-1][PROCESS_STACK_SIZE];
     memcpy(&new->ctx, &current->ctx, sizeof(context_t));
     new->ctx.sp = new->sp;
     
@@ -199,115 +893,60 @@ struct process* create_process(void) {
     extern void process3(void);  
     new->ctx.lr = (unsigned long)process3;
     
-    uart_puts("New context: LR=");
-    uart_hex(new->ctx.lr);
-    uart_puts("\n");
+    kprintf("New context: LR=%p\n", (void *)new->ctx.lr);
     
     return new;
 }
 
 
-int load_program(struct process *proc, const char *path) {
-    struct Message msg = {
-        .type = MSG_OPEN,
-        .path = (char*)path,
-        .flags = 0
-    };
-    
-    
-    if (send_message(&msg) < 0) {
-        return -1;
-    }
-    
-    
-    msg.type = MSG_READ;
-    msg.fd = msg.status;  
-    msg.data = (void*)proc->ctx.pc;  
-    msg.size = 4096;  
-    
-    if (send_message(&msg) < 0) {
-        return -1;
-    }
-    
-    
-    msg.type = MSG_CLOSE;
-    send_message(&msg);
-    
-    return 0;
-}
-
-
-int exec_process(char *path) {
-    struct process *current = get_current_process();
-    
-    
-    if (load_program(current, path) < 0) {
-        return -1;
-    }
-    
-    current->sp = (unsigned long)&process_stacks[process_count-1][PROCESS_STACK_SIZE];
-    
-    current->ctx.pc = PROCESS_LOAD_ADDR;  
-    
-    return 0;
-}
-
-
 int wait_for_child(int *status) {
     struct process *current = get_current_process();
-    current->state = PROC_BLOCKED;
+    set_process_state(current, PROC_BLOCKED);
     schedule();  
     return 0;
 }
 
 
 struct process* find_process(int pid) {
-    struct process *p = process_list;
+    struct process *p = pid_hash[pid_bucket(pid, pid_hash_size)];
     while (p) {
         if (p->pid == pid) {
             return p;
         }
-        p = p->next;
+        p = p->hash_next;
     }
     return NULL;
 }
 
 
 void exit_process(int status) {
-    struct process *current = get_current_process();
-    
-    uart_puts("Process ");
-    uart_hex(current->pid);
-    uart_puts(" exiting with status: ");
-    uart_hex(status);
-    uart_puts("\n");
-    
-    current->state = PROC_ZOMBIE;
-    current->exit_status = status;
-    
-    
-    struct process *parent = find_process(current->parent_pid);
-    if (parent && parent->state == PROC_BLOCKED) {
-        parent->state = PROC_READY;
-    }
-    
-    schedule();
+    process_exit(status);
 }
 
 
 void switch_to_process(struct process *next) {
     struct process *prev = current_process;
+    if (prev->state == PROC_RUNNING) {
+        set_process_state(prev, PROC_READY);
+    }
+    set_process_state(next, PROC_RUNNING);
     current_process = next;
+    next->ctx.ttbr0 = mmu_activate(&next->mm);
     context_switch(&prev->ctx, &next->ctx);
 }
 
 
 void init_processes(void) {
     
-    processes[0].pid = 1;
-    processes[0].state = PROC_RUNNING;
-    current_process = &processes[0];
-    process_list = current_process;
+    struct process *init = alloc_process();
+    if (!init) {
+        return;
+    }
+    init->pid = 1;
+    init->state = PROC_RUNNING;
+    init->priority = PRIO_DEFAULT;
+    publish_process(init, NULL);
+    current_process = init;
     
     timer_init();
     gic_init();
@@ -327,16 +966,27 @@ int handle_fork_message(struct Message *msg) {
     
     
     new->parent_pid = current->pid;
-    new->state = PROC_READY;
+    set_process_state(new, PROC_READY);
     
     
     memcpy(&new->ctx, &current->ctx, sizeof(context_t));
+    new->ctx.sp = new->sp;
     new->ctx.x[0] = 0;  
     new->ctx.pc = msg->entry;  
+
+    // forked from EL0: the child resumes from a copy of the parent's trap
+    // frame, at entry if one was given, and sees 0 from the call
+    if (current->tf) {
+        *new->tf = *current->tf;
+        new->tf->x[0] = 0;
+        if (msg->entry) {
+            new->tf->elr = msg->entry;
+        }
+        fpsimd_fork(new, current);
+        setup_ret_to_user(new);
+    }
     
-    uart_puts("Created process PID: ");
-    uart_hex(new->pid);
-    uart_puts("\n");
+    kprintf("Created process PID: %d\n", new->pid);
     
     msg->pid = new->pid;
     msg->status = 0;
@@ -344,52 +994,117 @@ int handle_fork_message(struct Message *msg) {
 }
 
 
+// reaps the most recently exited child, sleeping until there is one.
+// fails straight away for a process without children
 int handle_wait_message(struct Message *msg) {
     struct process *current = get_current_process();
     
-    
-    struct process *p;
-    for (p = process_list; p; p = p->next) {
-        if (p->parent_pid == current->pid && p->state == PROC_ZOMBIE) {
+    for (;;) {
+        struct process *p = current->zombies;
+        if (p) {
             msg->status = p->exit_status;
             msg->pid = p->pid;
-            p->state = PROC_DEAD;  
+            reap_process(p);
             return 0;
         }
+        if (!current->children) {
+            msg->status = -1;
+            return -1;
+        }
+
+        current->wait_blocked = 1;
+        set_process_state(current, PROC_BLOCKED);
+        schedule();
+        current->wait_blocked = 0;
     }
-    
-    
-    current->state = PROC_BLOCKED;
-    msg->status = 0;
-    schedule();
-    return 0;
 }
 
+// there is no way yet to replace a running image: that needs a fresh
+// address space loaded with process_load_image and the trap frame
+// pointed at it. fail loudly rather than pretend
 int handle_exec_message(struct Message *msg) {
-    if (!msg->path) {
+    uart_puts("exec: not supported\n");
+    msg->status = -1;
+    return -1;
+}
+
+
+// undo a failed process_load_image: the image and heap vmas, and with
+// them the pages and page table entries mapped so far
+static void unload_image(struct mm *mm, unsigned long va, unsigned long end) {
+    struct vma *v = mm->vmas;
+    while (v) {
+        struct vma *next = v->next;
+        if (v->start >= va && v->end <= end) {
+            vma_unmap(mm, v);
+        }
+        v = next;
+    }
+    mm->brk_start = mm->brk = 0;
+}
+
+// copy an image into fresh pages mapped at va in p's address space,
+// the program break starts right after it
+int process_load_image(struct process *p, unsigned long va, const void *src, size_t size) {
+    const char *from = src;
+    if (va & (PAGE_SIZE - 1)) {
         return -1;
     }
-    
-    uart_puts("Executing program: ");
-    uart_puts(msg->path);
-    uart_puts("\n");
-    
-    struct process *current = get_current_process();
-    current->ctx.pc = msg->entry;
-    current->ctx.sp = PROCESS_STACK_TOP;
-    
-    
-    for (int i = 0; i < 31; i++) {
-        current->ctx.x[i] = 0;
+
+    unsigned long end = va + PAGE_ALIGN(size);
+    if (vma_add(&p->mm, va, end, PROT_USER_RWX, 0) < 0) {
+        return -1;
     }
-    
-    
-    if (msg->argv) {
-        int argc = 0;
-        while (msg->argv[argc]) argc++;
-        current->ctx.x[0] = argc;
-        current->ctx.x[1] = (uint64_t)msg->argv;
+    if (vma_add(&p->mm, end, end, PROT_USER_RW, VMA_ANON | VMA_HEAP) < 0) {
+        unload_image(&p->mm, va, end);
+        return -1;
+    }
+    p->mm.brk_start = p->mm.brk = end;
+
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        char *page = page_alloc(0);
+        if (!page) {
+            uart_puts("Out of memory loading image\n");
+            unload_image(&p->mm, va, end);
+            return -1;
+        }
+        size_t chunk = size - off < PAGE_SIZE ? size - off : PAGE_SIZE;
+        memset(page, 0, PAGE_SIZE);
+        memcpy(page, from + off, chunk);
+        icache_sync_range(page, PAGE_SIZE);
+        if (mmu_map(&p->mm, va + off, virt_to_phys(page), PAGE_SIZE, PROT_USER_RWX) < 0) {
+            page_free(page);
+            unload_image(&p->mm, va, end);
+            return -1;
+        }
     }
-    
     return 0;
-}
\ No newline at end of file
+}
+
+// demand-zero stack below USER_STACK_TOP, nothing is allocated until it is
+// touched. returns the initial sp or 0
+unsigned long process_setup_user_stack(struct process *p) {
+    if (vma_add(&p->mm, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP,
+                PROT_USER_RW, VMA_ANON | VMA_GROWSDOWN) < 0) {
+        uart_puts("Cannot reserve user stack\n");
+        return 0;
+    }
+    return USER_STACK_TOP;
+}
+
+// zombie is gone for good, its pid goes away with everything it owned
+void reap_process(struct process *p) {
+    set_process_state(p, PROC_DEAD);
+    sibling_unlink(p);
+    pid_hash_remove(p);
+    if (p->prev) {
+        p->prev->next = p->next;
+    } else {
+        process_list = p->next;
+    }
+    if (p->next) {
+        p->next->prev = p->prev;
+    }
+    nr_processes--;
+    free_process(p);
+}
@@ -0,0 +1,178 @@
+#include "smp.h"
+#include "spinlock.h"
+#include "process.h"
+#include "mmu.h"
+#include "gic.h"
+#include "timer.h"
+#include "fdt.h"
+#include "memlayout.h"
+#include "uart.h"
+#include "fpsimd.h"
+#include "kprintf.h"
+
+/*
+ * secondary CPUs are started through PSCI CPU_ON, with the conduit and
+ * the CPU list taken from the device tree. QEMU virt passes one only to
+ * kernel.img, a bare kernel.elf gets none and we probe for CPUs instead.
+ * each one enters secondary_entry in boot.S and ends up in its idle task.
+ */
+
+#define PSCI_CPU_ON_64      0xC4000003UL
+#define PSCI_AFFINITY_INFO_64 0xC4000004UL
+#define PSCI_SUCCESS        0
+#define PSCI_ALREADY_ON     (-4)
+
+#define MPIDR_AFF_MASK      0xFF00FFFFFFUL
+
+struct cpu cpus[NR_CPUS];
+
+/* initial sp of each secondary, read by boot.S */
+uint64_t secondary_stacks[NR_CPUS];
+
+extern char secondary_entry[];
+
+static int nr_cpus = 1;
+static int psci_method = FDT_PSCI_HVC;
+static spinlock_t big_lock = SPINLOCK_INIT;
+
+static uint64_t read_mpidr(void) {
+    uint64_t v;
+    __asm__ volatile("mrs %0, mpidr_el1" : "=r"(v));
+    return v & MPIDR_AFF_MASK;
+}
+
+static int64_t psci_call(uint64_t fn, uint64_t a1, uint64_t a2, uint64_t a3) {
+    register uint64_t x0 __asm__("x0") = fn;
+    register uint64_t x1 __asm__("x1") = a1;
+    register uint64_t x2 __asm__("x2") = a2;
+    register uint64_t x3 __asm__("x3") = a3;
+    if (psci_method == FDT_PSCI_SMC) {
+        __asm__ volatile("smc #0" : "+r"(x0) : "r"(x1), "r"(x2), "r"(x3) : "memory");
+    } else {
+        __asm__ volatile("hvc #0" : "+r"(x0) : "r"(x1), "r"(x2), "r"(x3) : "memory");
+    }
+    return (int64_t)x0;
+}
+
+void smp_init(void) {
+    atomic_init();
+
+    struct cpu *c = &cpus[0];
+    c->id = 0;
+    c->online = 1;
+    c->mpidr = read_mpidr();
+    __asm__ volatile("msr tpidr_el1, %0" :: "r"(c));
+    fpsimd_init_cpu();
+}
+
+int smp_num_cpus(void) {
+    return nr_cpus;
+}
+
+void kernel_lock(void) {
+    spin_lock(&big_lock);
+}
+
+void kernel_unlock(void) {
+    spin_unlock(&big_lock);
+}
+
+#ifdef LOCK_STATS
+// not taken here, the caller may already hold it
+void kernel_lock_stats(struct lock_stats *out) {
+    lock_stats_read(&big_lock.stats, out);
+}
+#endif
+
+void smp_send_reschedule(int cpu) {
+    if (cpu != smp_processor_id() && cpus[cpu].online) {
+        gic_send_sgi(cpu, IPI_RESCHEDULE);
+    }
+}
+
+// first C code on a secondary, running on its idle task's stack
+void secondary_main(int id) {
+    struct cpu *c = &cpus[id];
+    __asm__ volatile("msr tpidr_el1, %0" :: "r"(c));
+
+    mmu_init_secondary();
+    gic_init_cpu();
+    timer_init_cpu();
+    fpsimd_init_cpu();
+
+    kernel_lock();
+    kprintf("CPU %d online, MPIDR %lx\n", id, c->mpidr);
+    c->online = 1;
+    kernel_unlock();
+
+    sched_start_cpu();
+}
+
+static int boot_cpu(int id, uint64_t mpidr) {
+    struct cpu *c = &cpus[id];
+    c->id = id;
+    c->mpidr = mpidr;
+    c->online = 0;
+
+    unsigned long stack = sched_init_cpu(id);
+    if (!stack) {
+        return -1;
+    }
+    secondary_stacks[id] = stack;
+
+    int64_t ret = psci_call(PSCI_CPU_ON_64, mpidr, virt_to_phys(secondary_entry), id);
+    if (ret != PSCI_SUCCESS && ret != PSCI_ALREADY_ON) {
+        kprintf("PSCI CPU_ON failed for MPIDR %lx: %ld\n", mpidr, ret);
+        return -1;
+    }
+
+    // give it a second to show up
+    uint64_t deadline = timer_now() + timer_tick_cycles() * TIMER_HZ;
+    while (!((volatile struct cpu *)c)->online) {
+        if (timer_now() > deadline) {
+            kprintf("CPU %d did not come up\n", id);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void smp_boot_secondaries(void) {
+    uint64_t mpidr[NR_CPUS];
+    int n = 0;
+
+    if (boot_dtb >= RAM_BASE && !(boot_dtb & 7)) {
+        const void *fdt = phys_to_virt(boot_dtb);
+        n = fdt_cpus(fdt, mpidr, NR_CPUS);
+        int method = fdt_psci_method(fdt);
+        if (method > 0) {
+            psci_method = method;
+        } else if (n > 1) {
+            uart_puts("SMP: no PSCI node, staying on one CPU\n");
+            return;
+        }
+    } else {
+#ifndef RPI4_BUILD
+        // no device tree. QEMU virt answers PSCI over HVC and numbers its
+        // CPUs in clusters of 8, AFFINITY_INFO fails for one that is absent
+        while (n < NR_CPUS) {
+            uint64_t id = ((uint64_t)(n / 8) << 8) | (n % 8);
+            if (psci_call(PSCI_AFFINITY_INFO_64, id, 0, 0) < 0) {
+                break;
+            }
+            mpidr[n++] = id;
+        }
+        uart_puts("SMP: no device tree, probed CPUs through PSCI\n");
+#endif
+    }
+
+    for (int i = 0; i < n; i++) {
+        if ((mpidr[i] & MPIDR_AFF_MASK) == cpus[0].mpidr) {
+            continue;
+        }
+        if (boot_cpu(nr_cpus, mpidr[i] & MPIDR_AFF_MASK) == 0) {
+            nr_cpus++;
+        }
+    }
+    kprintf("SMP: %d CPUs online\n", nr_cpus);
+}
@@ -0,0 +1,136 @@
+#include <stdarg.h>
+#include "stats.h"
+#include "kprintf.h"
+#include "kmalloc.h"
+#include "pool.h"
+#include "scratch.h"
+#include "mmu.h"
+#include "process.h"
+#include "fpsimd.h"
+#include "smp.h"
+
+struct report {
+    char *buf;
+    size_t size;
+    size_t n;
+};
+
+static void line(struct report *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void line(struct report *r, const char *fmt, ...) {
+    if (r->n + 1 >= r->size) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    size_t len = kvsnprintf(r->buf + r->n, r->size - r->n, fmt, ap);
+    va_end(ap);
+    r->n += len < r->size - r->n ? len : r->size - r->n - 1;
+}
+
+static void put_stat(struct report *r, const char *label, uint64_t value) {
+    line(r, "%s%lu\n", label, (unsigned long)value);
+}
+
+static void mem_report(struct report *r) {
+    size_t mark = scratch_mark();
+    struct kmem_info *info = scratch_alloc(sizeof(*info));
+    if (!info) {
+        line(r, "meminfo: out of scratch space\n");
+        return;
+    }
+    kmem_get_info(info);
+
+    put_stat(r, "heap live bytes:     ", info->live_bytes);
+    put_stat(r, "heap reserved bytes: ", info->reserved_bytes);
+    put_stat(r, "heap peak bytes:     ", info->peak_bytes);
+    put_stat(r, "slab bytes:          ", info->slab_bytes);
+    put_stat(r, "large block bytes:   ", info->large_bytes);
+    // slack inside size classes, and free slots sitting in slabs
+    put_stat(r, "internal waste:      ", info->reserved_bytes - info->live_bytes);
+    put_stat(r, "slab free bytes:     ", info->slab_bytes + info->large_bytes - info->reserved_bytes);
+    put_stat(r, "allocs:              ", info->allocs);
+    put_stat(r, "frees:               ", info->frees);
+    put_stat(r, "allocs/sec:          ", info->allocs_per_sec);
+    put_stat(r, "free pages:          ", info->free_pages);
+    put_stat(r, "total pages:         ", info->total_pages);
+
+    struct tlb_stats tlb;
+    mmu_tlb_stats(&tlb);
+    put_stat(r, "tlb full flushes:    ", tlb.full_flushes);
+    put_stat(r, "tlb asid flushes:    ", tlb.asid_flushes);
+    put_stat(r, "tlb page flushes:    ", tlb.page_flushes);
+    put_stat(r, "asid rollovers:      ", tlb.rollovers);
+    put_stat(r, "address space loads: ", tlb.switches);
+
+    line(r, "tag        live       peak       allocs     fails\n");
+    for (int t = 0; t < KMEM_NR_TAGS; t++) {
+        line(r, "%-10s %-10lu %-10lu %-10lu %lu\n", kmem_tag_name(t),
+             (unsigned long)info->tags[t].live_bytes,
+             (unsigned long)info->tags[t].peak_bytes,
+             (unsigned long)info->tags[t].allocs,
+             (unsigned long)info->tags[t].failures);
+    }
+
+    line(r, "call sites:\n");
+    for (int i = 0; i < KMEM_NR_SITES && info->sites[i].site; i++) {
+        line(r, "  %p %s live %lu allocs %lu\n", (void *)info->sites[i].site,
+             kmem_tag_name(info->sites[i].tag),
+             (unsigned long)info->sites[i].live_bytes,
+             (unsigned long)info->sites[i].allocs);
+    }
+    scratch_release(mark);
+
+    line(r, "pools:\n");
+    for (struct obj_pool *p = pool_list(); p; p = p->next) {
+        line(r, "  %s: size %zu in use %zu high water %zu hits %lu misses %lu\n",
+             p->name, p->obj_size, p->in_use, p->high_water,
+             (unsigned long)p->hits, (unsigned long)p->misses);
+    }
+}
+
+static void sched_report(struct report *r) {
+    for (int cpu = 0; cpu < smp_num_cpus(); cpu++) {
+        struct idle_stats idle;
+        sched_idle_stats(cpu, &idle);
+        put_stat(r, "cpu:                 ", cpu);
+        put_stat(r, "  idle cycles:       ", idle.idle_cycles);
+        put_stat(r, "  idle wakeups:      ", idle.wakeups);
+        put_stat(r, "  idle entries:      ", idle.entries);
+
+        struct sched_stats st;
+        sched_cpu_stats(cpu, &st);
+        put_stat(r, "  steals:            ", st.steals);
+        put_stat(r, "  migrations:        ", st.migrations);
+        put_stat(r, "  balance kicks:     ", st.balance_kicks);
+
+        struct fpsimd_stats fp;
+        fpsimd_cpu_stats(cpu, &fp);
+        put_stat(r, "  fp restores:       ", fp.restores);
+        put_stat(r, "  fp saves:          ", fp.saves);
+        put_stat(r, "  fp reuses:         ", fp.reuses);
+        put_stat(r, "  fp first uses:     ", fp.first_uses);
+    }
+
+#ifdef LOCK_STATS
+    struct lock_stats kl;
+    kernel_lock_stats(&kl);
+    put_stat(r, "kernel lock taken:   ", kl.acquired);
+    put_stat(r, "  contended:         ", kl.contended);
+    put_stat(r, "  wait cycles:       ", kl.wait_cycles);
+#endif
+}
+
+size_t stats_report(int which, char *buf, size_t size) {
+    struct report r = { buf, size, 0 };
+    if (!size) {
+        return 0;
+    }
+    buf[0] = '\0';
+    if (which == STATS_MEM) {
+        mem_report(&r);
+    } else if (which == STATS_SCHED) {
+        sched_report(&r);
+    }
+    return r.n;
+}
@@ -1,19 +1,326 @@
 #include "kmalloc.h"
+#include "page_alloc.h"
+#include "string.h"
+#include <stdint.h>
 
-static char heap[1024 * 1024];  
-static size_t heap_pos = 0;
+/*
+ * kernel heap
+ *
+ * small requests (up to 2 KiB) come from power-of-two size classes. each
+ * class owns a set of slabs, a slab is one page from the buddy allocator
+ * carved into equal objects with its own free list. slabs that still have
+ * free objects sit on the class partial list, so alloc and free are O(1).
+ *
+ * bigger requests go straight to the page allocator as a 2^order block.
+ *
+ * every allocation carries a 16 byte header in front of it recording the
+ * requested size, the subsystem tag and the call site, so meminfo can say
+ * who is holding the heap without a debugger attached.
+ */
 
-void* kalloc(size_t size) {
-    if (heap_pos + size > sizeof(heap)) {
+#define MIN_CLASS_SHIFT 4       /* 16 bytes */
+#define MAX_CLASS_SHIFT 11      /* 2048 bytes */
+#define NUM_CLASSES     (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+#define MAX_SMALL_SIZE  (1UL << MAX_CLASS_SHIFT)
+
+#define HDR_MAGIC       0xa110
+#define NO_SITE         0xff
+
+struct alloc_hdr {
+    uint32_t size;              /* requested size */
+    uint8_t tag;
+    uint8_t site;               /* index into sites[], NO_SITE if untracked */
+    uint16_t magic;
+    uint64_t caller;
+};
+
+struct slab_class {
+    struct page *partial;       /* slabs with at least one free object */
+    int nr_partial;
+    uint16_t objs_per_slab;
+};
+
+static struct slab_class classes[NUM_CLASSES];
+static int heap_ready = 0;
+
+/* accounting */
+static struct kmem_tag_stats tag_stats[KMEM_NR_TAGS];
+static struct kmem_site_stats sites[KMEM_NR_SITES];
+static int nr_sites = 0;
+static uint64_t live_bytes, reserved_bytes, peak_bytes;
+static uint64_t slab_bytes, large_bytes;
+static uint64_t total_allocs, total_frees;
+static uint64_t last_allocs, last_stamp;
+
+static const char *tag_names[KMEM_NR_TAGS] = {
+    "misc", "vfs", "abyssfs", "namespace", "process", "ipc"
+};
+
+static inline uint64_t read_cntpct(void) {
+    uint64_t v;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(v));
+    return v;
+}
+
+static inline uint64_t read_cntfrq(void) {
+    uint64_t v;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(v));
+    return v;
+}
+
+static void list_add(struct page **list, struct page *pg) {
+    pg->prev = NULL;
+    pg->next = *list;
+    if (*list) {
+        (*list)->prev = pg;
+    }
+    *list = pg;
+}
+
+static void list_del(struct page **list, struct page *pg) {
+    if (pg->prev) {
+        pg->prev->next = pg->next;
+    } else {
+        *list = pg->next;
+    }
+    if (pg->next) {
+        pg->next->prev = pg->prev;
+    }
+    pg->next = pg->prev = NULL;
+}
+
+static void heap_init(void) {
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        classes[c].partial = NULL;
+        classes[c].nr_partial = 0;
+        classes[c].objs_per_slab = PAGE_SIZE >> (c + MIN_CLASS_SHIFT);
+    }
+    last_stamp = read_cntpct();
+    heap_ready = 1;
+}
+
+static inline int size_class(size_t size) {
+    if (size <= (1UL << MIN_CLASS_SHIFT)) {
+        return 0;
+    }
+    int shift = 64 - __builtin_clzl(size - 1);
+    return shift - MIN_CLASS_SHIFT;
+}
+
+static struct page *slab_new(int c) {
+    struct page *pg = alloc_pages(0);
+    if (!pg) {
+        return NULL;
+    }
+
+    size_t obj_size = 1UL << (c + MIN_CLASS_SHIFT);
+    char *base = page_to_virt(pg);
+
+    /* thread the free list through the objects */
+    pg->freelist = NULL;
+    for (int i = classes[c].objs_per_slab - 1; i >= 0; i--) {
+        void **obj = (void **)(base + i * obj_size);
+        *obj = pg->freelist;
+        pg->freelist = obj;
+    }
+    pg->flags |= PG_SLAB;
+    pg->slab_class = c;
+    pg->inuse = 0;
+
+    list_add(&classes[c].partial, pg);
+    classes[c].nr_partial++;
+    slab_bytes += PAGE_SIZE;
+    return pg;
+}
+
+/* call sites are few, a linear scan of a small table is plenty */
+static int site_index(uint64_t caller, int tag) {
+    for (int i = 0; i < nr_sites; i++) {
+        if (sites[i].site == caller) {
+            return i;
+        }
+    }
+    if (nr_sites == KMEM_NR_SITES) {
+        return NO_SITE;
+    }
+    sites[nr_sites].site = caller;
+    sites[nr_sites].tag = tag;
+    return nr_sites++;
+}
+
+static void account_alloc(struct alloc_hdr *hdr, size_t reserved) {
+    struct kmem_tag_stats *ts = &tag_stats[hdr->tag];
+    ts->allocs++;
+    ts->live_bytes += hdr->size;
+    if (ts->live_bytes > ts->peak_bytes) {
+        ts->peak_bytes = ts->live_bytes;
+    }
+
+    total_allocs++;
+    live_bytes += hdr->size;
+    reserved_bytes += reserved;
+    if (live_bytes > peak_bytes) {
+        peak_bytes = live_bytes;
+    }
+
+    hdr->site = site_index(hdr->caller, hdr->tag);
+    if (hdr->site != NO_SITE) {
+        sites[hdr->site].allocs++;
+        sites[hdr->site].live_bytes += hdr->size;
+    }
+}
+
+static void account_free(struct alloc_hdr *hdr, size_t reserved) {
+    tag_stats[hdr->tag].frees++;
+    tag_stats[hdr->tag].live_bytes -= hdr->size;
+    total_frees++;
+    live_bytes -= hdr->size;
+    reserved_bytes -= reserved;
+    if (hdr->site != NO_SITE) {
+        sites[hdr->site].live_bytes -= hdr->size;
+    }
+}
+
+static void *heap_alloc(size_t size, int tag, uint64_t caller) {
+    if (!heap_ready) {
+        heap_init();
+    }
+    if (tag < 0 || tag >= KMEM_NR_TAGS) {
+        tag = KMEM_MISC;
+    }
+    if (size == 0) {
         return NULL;
     }
-    void* ptr = &heap[heap_pos];
-    heap_pos += size;
-    return ptr;
+
+    size_t total = size + sizeof(struct alloc_hdr);
+    struct alloc_hdr *hdr;
+    size_t reserved;
+
+    if (total > MAX_SMALL_SIZE) {
+        struct page *pg = alloc_pages(get_order(total));
+        if (!pg) {
+            tag_stats[tag].failures++;
+            return NULL;
+        }
+        pg->flags |= PG_LARGE;
+        reserved = PAGE_SIZE << pg->order;
+        large_bytes += reserved;
+        hdr = page_to_virt(pg);
+    } else {
+        int c = size_class(total);
+        struct slab_class *sc = &classes[c];
+        struct page *pg = sc->partial;
+        if (!pg) {
+            pg = slab_new(c);
+            if (!pg) {
+                tag_stats[tag].failures++;
+                return NULL;
+            }
+        }
+
+        void **obj = pg->freelist;
+        pg->freelist = *obj;
+        pg->inuse++;
+
+        /* full slabs leave the partial list until something is freed */
+        if (!pg->freelist) {
+            list_del(&sc->partial, pg);
+            sc->nr_partial--;
+        }
+        reserved = 1UL << (c + MIN_CLASS_SHIFT);
+        hdr = (struct alloc_hdr *)obj;
+    }
+
+    /* callers expect fresh memory to be zeroed, like the old bump heap */
+    memset(hdr, 0, reserved);
+    hdr->size = size;
+    hdr->tag = tag;
+    hdr->magic = HDR_MAGIC;
+    hdr->caller = caller;
+    account_alloc(hdr, reserved);
+    return hdr + 1;
+}
+
+void* kalloc(size_t size) {
+    return heap_alloc(size, KMEM_MISC, (uint64_t)__builtin_return_address(0));
+}
+
+void* kalloc_tag(size_t size, int tag) {
+    return heap_alloc(size, tag, (uint64_t)__builtin_return_address(0));
 }
 
 void kfree(void* ptr) {
-    
-    
-    (void)ptr;
-} 
\ No newline at end of file
+    if (!ptr) {
+        return;
+    }
+    struct alloc_hdr *hdr = (struct alloc_hdr *)ptr - 1;
+    struct page *pg = virt_to_page(hdr);
+    if (!pg || hdr->magic != HDR_MAGIC) {
+        return;
+    }
+    hdr->magic = 0;
+
+    if (pg->flags & PG_LARGE) {
+        size_t reserved = PAGE_SIZE << pg->order;
+        account_free(hdr, reserved);
+        large_bytes -= reserved;
+        free_pages(pg);
+        return;
+    }
+    if (!(pg->flags & PG_SLAB)) {
+        return;
+    }
+
+    struct slab_class *sc = &classes[pg->slab_class];
+    account_free(hdr, 1UL << (pg->slab_class + MIN_CLASS_SHIFT));
+    if (!pg->freelist) {
+        /* was full, back onto the partial list */
+        list_add(&sc->partial, pg);
+        sc->nr_partial++;
+    }
+    *(void **)hdr = pg->freelist;
+    pg->freelist = hdr;
+    pg->inuse--;
+
+    /* keep one empty slab per class around, hand the rest back */
+    if (pg->inuse == 0 && sc->nr_partial > 1) {
+        list_del(&sc->partial, pg);
+        sc->nr_partial--;
+        slab_bytes -= PAGE_SIZE;
+        free_pages(pg);
+    }
+}
+
+const char *kmem_tag_name(int tag) {
+    if (tag < 0 || tag >= KMEM_NR_TAGS) {
+        return "?";
+    }
+    return tag_names[tag];
+}
+
+void kmem_get_info(struct kmem_info *info) {
+    if (!heap_ready) {
+        heap_init();
+    }
+    memset(info, 0, sizeof(*info));
+    memcpy(info->tags, tag_stats, sizeof(tag_stats));
+    memcpy(info->sites, sites, nr_sites * sizeof(sites[0]));
+    info->live_bytes = live_bytes;
+    info->reserved_bytes = reserved_bytes;
+    info->peak_bytes = peak_bytes;
+    info->slab_bytes = slab_bytes;
+    info->large_bytes = large_bytes;
+    info->allocs = total_allocs;
+    info->frees = total_frees;
+    info->free_pages = page_alloc_free_pages();
+    info->total_pages = page_alloc_total_pages();
+
+    /* allocation rate over the window since the last snapshot */
+    uint64_t now = read_cntpct();
+    uint64_t elapsed = now - last_stamp;
+    if (elapsed) {
+        info->allocs_per_sec = (total_allocs - last_allocs) * read_cntfrq() / elapsed;
+    }
+    last_stamp = now;
+    last_allocs = total_allocs;
+}
@@ -0,0 +1,267 @@
+#include "page_alloc.h"
+#include "memlayout.h"
+#include "fdt.h"
+#include "uart.h"
+#include "string.h"
+#include "kprintf.h"
+
+/*
+ * physical page frame allocator, binary buddy system
+ *
+ * every page frame between RAM_BASE and the end of RAM has a struct page
+ * in mem_map. free blocks of 2^order pages sit on free_area[order], a
+ * freed block is merged with its buddy (pfn ^ (1 << order)) for as long
+ * as the buddy is free too, so alloc and free are O(MAX_ORDER).
+ */
+
+extern char _kernel_end[];
+
+struct free_area {
+    struct page *head;
+    size_t nr_free;
+};
+
+static struct free_area free_area[MAX_ORDER + 1];
+static struct page *mem_map = NULL;
+static uint64_t base_pfn;
+static uint64_t end_pfn;
+static uint64_t ram_end;
+static size_t total_pages;
+static size_t free_pages_count;
+static uint64_t dtb_hole_start;
+static uint64_t dtb_hole_end;
+
+static inline uint64_t page_pfn(struct page *pg) {
+    return base_pfn + (pg - mem_map);
+}
+
+static inline struct page *pfn_page(uint64_t pfn) {
+    return &mem_map[pfn - base_pfn];
+}
+
+static void area_add(unsigned int order, struct page *pg) {
+    struct free_area *area = &free_area[order];
+    pg->flags = PG_BUDDY;
+    pg->order = order;
+    pg->prev = NULL;
+    pg->next = area->head;
+    if (area->head) {
+        area->head->prev = pg;
+    }
+    area->head = pg;
+    area->nr_free++;
+}
+
+static void area_del(unsigned int order, struct page *pg) {
+    struct free_area *area = &free_area[order];
+    if (pg->prev) {
+        pg->prev->next = pg->next;
+    } else {
+        area->head = pg->next;
+    }
+    if (pg->next) {
+        pg->next->prev = pg->prev;
+    }
+    pg->next = pg->prev = NULL;
+    pg->flags &= ~PG_BUDDY;
+    area->nr_free--;
+}
+
+/* hand [start, end) to the allocator in the biggest aligned blocks we can */
+static void add_range(uint64_t start, uint64_t end) {
+    uint64_t pfn = PAGE_ALIGN(start) >> PAGE_SHIFT;
+    uint64_t last = end >> PAGE_SHIFT;
+
+    while (pfn < last) {
+        unsigned int order = MAX_ORDER;
+        while (order > 0 && ((pfn & ((1UL << order) - 1)) || pfn + (1UL << order) > last)) {
+            order--;
+        }
+        for (uint64_t i = 0; i < (1UL << order); i++) {
+            pfn_page(pfn + i)->flags = 0;
+        }
+        area_add(order, pfn_page(pfn));
+        free_pages_count += 1UL << order;
+        total_pages += 1UL << order;
+        pfn += 1UL << order;
+    }
+}
+
+/* like add_range, but never hands out the pages the DTB lives in */
+static void add_free(uint64_t start, uint64_t end) {
+    if (dtb_hole_end <= start || dtb_hole_start >= end) {
+        add_range(start, end);
+        return;
+    }
+    if (dtb_hole_start > start) {
+        add_range(start, dtb_hole_start);
+    }
+    if (dtb_hole_end < end) {
+        add_range(dtb_hole_end, end);
+    }
+}
+
+void page_alloc_init(void) {
+    uint64_t mem_base = RAM_BASE;
+    uint64_t mem_size = USER_BASE - RAM_BASE;
+    uint64_t dtb_end = 0;
+
+    // the DTB QEMU passed in x0 knows how much RAM -m gave us
+    // boot maps the first 4 GiB, which is where QEMU puts it. only an
+    // arm64 Image gets one, kernel.elf boots without
+    if (boot_dtb >= RAM_BASE && !(boot_dtb & 7) &&
+        fdt_memory_range(phys_to_virt(boot_dtb), &mem_base, &mem_size) == 0) {
+        dtb_end = boot_dtb + fdt_total_size(phys_to_virt(boot_dtb));
+    } else {
+        mem_base = RAM_BASE;
+        mem_size = USER_BASE - RAM_BASE;
+        kprintf("page_alloc: no device tree, using only %p-%p whatever -m says, boot kernel.img\n",
+                (void *)mem_base, (void *)(mem_base + mem_size));
+    }
+
+    ram_end = mem_base + mem_size;
+    base_pfn = RAM_BASE >> PAGE_SHIFT;
+    end_pfn = ram_end >> PAGE_SHIFT;
+
+    /* mem_map goes right after the kernel image, or after the DTB if it would overlap */
+    size_t map_size = (end_pfn - base_pfn) * sizeof(struct page);
+    uint64_t first_free = PAGE_ALIGN(virt_to_phys(_kernel_end));
+    if (dtb_end && boot_dtb < first_free + map_size && dtb_end > first_free) {
+        first_free = PAGE_ALIGN(dtb_end);
+    }
+    if (dtb_end) {
+        dtb_hole_start = boot_dtb & ~(PAGE_SIZE - 1);
+        dtb_hole_end = PAGE_ALIGN(dtb_end);
+    }
+
+    mem_map = phys_to_virt(first_free);
+    memset(mem_map, 0, map_size);
+    for (uint64_t pfn = base_pfn; pfn < end_pfn; pfn++) {
+        pfn_page(pfn)->flags = PG_RESERVED;
+    }
+    first_free = PAGE_ALIGN(first_free + map_size);
+
+    add_free(first_free, ram_end);
+
+    kprintf("page_alloc: RAM end %p, free pages %zu\n", (void *)ram_end, free_pages_count);
+}
+
+struct page *alloc_pages(unsigned int order) {
+    if (order > MAX_ORDER) {
+        return NULL;
+    }
+
+    unsigned int o = order;
+    while (o <= MAX_ORDER && !free_area[o].head) {
+        o++;
+    }
+    if (o > MAX_ORDER) {
+        return NULL;
+    }
+
+    struct page *pg = free_area[o].head;
+    area_del(o, pg);
+
+    /* split, the upper halves go back on the smaller lists */
+    while (o > order) {
+        o--;
+        area_add(o, pg + (1UL << o));
+    }
+
+    pg->flags = PG_HEAD;
+    pg->order = order;
+    pg->refcount = 1;
+    free_pages_count -= 1UL << order;
+    return pg;
+}
+
+void get_page(struct page *pg) {
+    if (pg && (pg->flags & PG_HEAD)) {
+        pg->refcount++;
+    }
+}
+
+void put_page(struct page *pg) {
+    if (!pg || !(pg->flags & PG_HEAD)) {
+        return;
+    }
+    if (--pg->refcount == 0) {
+        free_pages(pg);
+    }
+}
+
+void free_pages(struct page *pg) {
+    if (!pg || !(pg->flags & PG_HEAD)) {
+        return;
+    }
+
+    unsigned int order = pg->order;
+    uint64_t pfn = page_pfn(pg);
+    free_pages_count += 1UL << order;
+    pg->flags = 0;
+
+    while (order < MAX_ORDER) {
+        uint64_t buddy_pfn = pfn ^ (1UL << order);
+        if (buddy_pfn < base_pfn || buddy_pfn >= end_pfn) {
+            break;
+        }
+        struct page *buddy = pfn_page(buddy_pfn);
+        if (!(buddy->flags & PG_BUDDY) || buddy->order != order) {
+            break;
+        }
+        area_del(order, buddy);
+        pfn &= ~(1UL << order);
+        order++;
+    }
+
+    area_add(order, pfn_page(pfn));
+}
+
+void *page_alloc(unsigned int order) {
+    struct page *pg = alloc_pages(order);
+    return pg ? page_to_virt(pg) : NULL;
+}
+
+void page_free(void *addr) {
+    free_pages(virt_to_page(addr));
+}
+
+struct page *virt_to_page(const void *addr) {
+    uint64_t pfn = virt_to_phys(addr) >> PAGE_SHIFT;
+    if (!mem_map || pfn < base_pfn || pfn >= end_pfn) {
+        return NULL;
+    }
+    return pfn_page(pfn);
+}
+
+void *page_to_virt(struct page *pg) {
+    return phys_to_virt(page_pfn(pg) << PAGE_SHIFT);
+}
+
+unsigned int get_order(size_t size) {
+    unsigned int order = 0;
+    size = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    while ((1UL << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+uint64_t page_alloc_ram_end(void) {
+    return ram_end;
+}
+
+size_t page_alloc_free_pages(void) {
+    return free_pages_count;
+}
+
+size_t page_alloc_total_pages(void) {
+    return total_pages;
+}
+
+void page_alloc_dump(void) {
+    kprintf("page_alloc: free %zu of %zu pages\n", free_pages_count, total_pages);
+    for (int o = 0; o <= MAX_ORDER; o++) {
+        kprintf("  order %2d: %zu\n", o, free_area[o].nr_free);
+    }
+}
@@ -0,0 +1,80 @@
+#include "pool.h"
+#include "page_alloc.h"
+#include "string.h"
+#include "uart.h"
+#include "kprintf.h"
+
+static struct obj_pool *pools = NULL;
+
+static void pool_setup(struct obj_pool *pool) {
+    pool->obj_size = (pool->obj_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    pool->free_list = NULL;
+    pool->next = pools;
+    pools = pool;
+    pool->ready = 1;
+}
+
+/* carve a fresh page (or more, for big objects) into free objects */
+static int pool_grow(struct obj_pool *pool) {
+    unsigned int order = get_order(pool->obj_size);
+    char *chunk = page_alloc(order);
+    if (!chunk) {
+        return -1;
+    }
+
+    size_t count = (PAGE_SIZE << order) / pool->obj_size;
+    for (size_t i = 0; i < count; i++) {
+        void **obj = (void **)(chunk + i * pool->obj_size);
+        *obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    pool->total += count;
+    return 0;
+}
+
+void *pool_alloc(struct obj_pool *pool) {
+    if (!pool->ready) {
+        pool_setup(pool);
+    }
+
+    if (pool->free_list) {
+        pool->hits++;
+    } else {
+        pool->misses++;
+        if (pool_grow(pool) < 0) {
+            return NULL;
+        }
+    }
+
+    void **obj = pool->free_list;
+    pool->free_list = *obj;
+
+    pool->in_use++;
+    if (pool->in_use > pool->high_water) {
+        pool->high_water = pool->in_use;
+    }
+
+    memset(obj, 0, pool->obj_size);
+    return obj;
+}
+
+void pool_free(struct obj_pool *pool, void *obj) {
+    if (!obj) {
+        return;
+    }
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->in_use--;
+}
+
+struct obj_pool *pool_list(void) {
+    return pools;
+}
+
+void pool_dump_stats(void) {
+    for (struct obj_pool *p = pools; p; p = p->next) {
+        kprintf("%s: size %zu in use %zu high water %zu hits %lu misses %lu\n",
+                p->name, p->obj_size, p->in_use, p->high_water,
+                (unsigned long)p->hits, (unsigned long)p->misses);
+    }
+}
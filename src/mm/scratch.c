@@ -0,0 +1,70 @@
+#include "scratch.h"
+#include "page_alloc.h"
+#include "smp.h"
+#include "uart.h"
+
+#define SCRATCH_ORDER   3       /* 32 KiB per CPU */
+#define SCRATCH_SIZE    (PAGE_SIZE << SCRATCH_ORDER)
+#define SCRATCH_ALIGN   16
+
+/* a mark is the arena's top with the CPU it belongs to above it */
+#define MARK_CPU_SHIFT  32
+#define MARK_TOP(m)     ((m) & ((1UL << MARK_CPU_SHIFT) - 1))
+
+struct scratch_arena {
+    char *base;
+    size_t top;
+    size_t peak;
+};
+
+static struct scratch_arena arenas[NR_CPUS];
+
+static inline struct scratch_arena *mark_arena(size_t mark) {
+    return &arenas[mark >> MARK_CPU_SHIFT];
+}
+
+void *scratch_alloc(size_t size) {
+    struct scratch_arena *a = &arenas[smp_processor_id()];
+
+    if (!a->base) {
+        a->base = page_alloc(SCRATCH_ORDER);
+        if (!a->base) {
+            return NULL;
+        }
+    }
+
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    if (a->top + size > SCRATCH_SIZE) {
+        uart_puts("scratch: arena exhausted\n");
+        return NULL;
+    }
+
+    void *p = a->base + a->top;
+    a->top += size;
+    if (a->top > a->peak) {
+        a->peak = a->top;
+    }
+    return p;
+}
+
+size_t scratch_mark(void) {
+    int cpu = smp_processor_id();
+    return ((size_t)cpu << MARK_CPU_SHIFT) | arenas[cpu].top;
+}
+
+void scratch_release(size_t mark) {
+    if (mark == SCRATCH_NO_MARK) {
+        return;
+    }
+    struct scratch_arena *a = mark_arena(mark);
+    if (MARK_TOP(mark) < a->top) {
+        a->top = MARK_TOP(mark);
+    }
+}
+
+int scratch_held(size_t mark) {
+    if (mark == SCRATCH_NO_MARK) {
+        return 0;
+    }
+    return MARK_TOP(mark) < mark_arena(mark)->top;
+}
@@ -0,0 +1,132 @@
+#include "shm.h"
+#include "process.h"
+#include "vma.h"
+#include "kmalloc.h"
+#include "page_alloc.h"
+#include "memlayout.h"
+#include "string.h"
+#include "uart.h"
+
+static struct shm_object objects[SHM_MAX_OBJECTS];
+
+static void shm_destroy(struct shm_object *obj) {
+    for (size_t i = 0; i < obj->npages; i++) {
+        put_page(virt_to_page(obj->pages[i]));
+    }
+    kfree(obj->pages);
+    obj->pages = NULL;
+    obj->npages = 0;
+    obj->id = 0;
+}
+
+// the object starts with no mappings, the first shm_map takes the reference
+struct shm_object *shm_create(size_t size) {
+    if (size == 0 || size > SHM_MAX_SIZE) {
+        return NULL;
+    }
+
+    struct shm_object *obj = NULL;
+    for (int i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (!objects[i].id) {
+            obj = &objects[i];
+            obj->id = i + 1;
+            break;
+        }
+    }
+    if (!obj) {
+        uart_puts("shm: object table full\n");
+        return NULL;
+    }
+
+    obj->npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    obj->refs = 0;
+    obj->pages = kalloc_tag(obj->npages * sizeof(void *), KMEM_IPC);
+    if (!obj->pages) {
+        obj->npages = 0;
+        obj->id = 0;
+        return NULL;
+    }
+    for (size_t i = 0; i < obj->npages; i++) {
+        obj->pages[i] = page_alloc(0);
+        if (!obj->pages[i]) {
+            obj->npages = i;
+            shm_destroy(obj);
+            return NULL;
+        }
+        memset(obj->pages[i], 0, PAGE_SIZE);
+    }
+    return obj;
+}
+
+struct shm_object *shm_lookup(int id) {
+    if (id < 1 || id > SHM_MAX_OBJECTS || objects[id - 1].id != id) {
+        return NULL;
+    }
+    return &objects[id - 1];
+}
+
+void shm_get(struct shm_object *obj) {
+    obj->refs++;
+}
+
+void shm_put(struct shm_object *obj) {
+    if (--obj->refs <= 0) {
+        shm_destroy(obj);
+    }
+}
+
+uint64_t shm_map(struct shm_object *obj, struct process *p, int rdonly) {
+    struct mm *mm = &p->mm;
+    uint64_t size = obj->npages << PAGE_SHIFT;
+    uint64_t prot = (rdonly ? PROT_USER_RO : PROT_USER_RW) | PTE_SHARED;
+
+    uint64_t addr = vma_find_free(mm, size);
+    if (!addr || vma_add(mm, addr, addr + size, prot, VMA_SHM) < 0) {
+        // a fresh object nobody managed to map is gone again
+        if (!obj->refs) {
+            shm_destroy(obj);
+        }
+        return 0;
+    }
+    struct vma *v = vma_find(mm, addr);
+    v->obj = obj;
+    shm_get(obj);
+
+    // every mapping holds its own reference on each page
+    for (size_t i = 0; i < obj->npages; i++) {
+        get_page(virt_to_page(obj->pages[i]));
+        if (mmu_map(mm, addr + (i << PAGE_SHIFT), virt_to_phys(obj->pages[i]), PAGE_SIZE, prot) < 0) {
+            put_page(virt_to_page(obj->pages[i]));
+            vma_unmap(mm, v);
+            return 0;
+        }
+    }
+    return addr;
+}
+
+int shm_unmap(struct process *p, uint64_t addr) {
+    struct vma *v = vma_find(&p->mm, addr);
+    if (!v || !(v->flags & VMA_SHM) || v->start != addr) {
+        return -1;
+    }
+    vma_unmap(&p->mm, v);
+    return 0;
+}
+
+int shm_is_mapped(struct shm_object *obj, struct process *p) {
+    for (struct vma *v = p->mm.vmas; v; v = v->next) {
+        if ((v->flags & VMA_SHM) && v->obj == obj) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int shm_is_writable(struct shm_object *obj, struct process *p) {
+    for (struct vma *v = p->mm.vmas; v; v = v->next) {
+        if ((v->flags & VMA_SHM) && v->obj == obj && !(v->prot & PTE_RDONLY)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,280 @@
+#include "vma.h"
+#include "pool.h"
+#include "page_alloc.h"
+#include "memlayout.h"
+#include "string.h"
+#include "uart.h"
+#include "shm.h"
+#include "vfs.h"
+
+static DEFINE_POOL(vma_pool, struct vma);
+
+static inline int overlaps(struct vma *v, uint64_t start, uint64_t end) {
+    return start < v->end && end > v->start;
+}
+
+int vma_add(struct mm *mm, uint64_t start, uint64_t end, uint64_t prot, int flags) {
+    if ((start | end) & (PAGE_SIZE - 1) || start > end ||
+        start < USER_BASE || end > USER_END) {
+        return -1;
+    }
+
+    struct vma **link = &mm->vmas;
+    while (*link && (*link)->end <= start) {
+        link = &(*link)->next;
+    }
+    if (*link && overlaps(*link, start, end)) {
+        return -1;
+    }
+
+    struct vma *v = pool_alloc(&vma_pool);
+    if (!v) {
+        return -1;
+    }
+    v->start = start;
+    v->end = end;
+    v->prot = prot;
+    v->flags = flags;
+    v->obj = NULL;
+    v->next = *link;
+    *link = v;
+    return 0;
+}
+
+struct vma *vma_find(struct mm *mm, uint64_t addr) {
+    for (struct vma *v = mm->vmas; v && v->start <= addr; v = v->next) {
+        if (addr < v->end) {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// highest gap of size bytes below USER_MMAP_TOP, 0 if there is none
+uint64_t vma_find_free(struct mm *mm, uint64_t size) {
+    uint64_t top = USER_MMAP_TOP;
+    uint64_t best = 0;
+    size = PAGE_ALIGN(size);
+
+    // the list is sorted, remember the last gap that still fits under top
+    uint64_t prev_end = USER_BASE;
+    for (struct vma *v = mm->vmas; v; v = v->next) {
+        uint64_t gap_end = v->start < top ? v->start : top;
+        if (gap_end > prev_end && gap_end - prev_end >= size) {
+            best = gap_end - size;
+        }
+        if (v->end > prev_end) {
+            prev_end = v->end;
+        }
+    }
+    if (top > prev_end && top - prev_end >= size) {
+        best = top - size;
+    }
+    return best;
+}
+
+// stack vma that may grow down to cover addr, NULL if addr is out of reach
+static struct vma *stack_for(struct mm *mm, uint64_t addr) {
+    struct vma *prev = NULL;
+    for (struct vma *v = mm->vmas; v; prev = v, v = v->next) {
+        if (v->start <= addr) {
+            continue;
+        }
+        if (!(v->flags & VMA_GROWSDOWN) || addr < v->end - USER_STACK_MAX) {
+            return NULL;
+        }
+        if (prev && addr < prev->end + USER_STACK_GUARD) {
+            return NULL;
+        }
+        return v;
+    }
+    return NULL;
+}
+
+// give back the frames behind [start, end)
+static void release_range(struct mm *mm, uint64_t start, uint64_t end) {
+    for (uint64_t va = start; va < end; va += PAGE_SIZE) {
+        pte_t *e = mmu_walk(mm, va, NULL);
+        if (!e) {
+            continue;
+        }
+        struct page *pg = virt_to_page(phys_to_virt(*e & PTE_ADDR_MASK));
+        if (mmu_unmap(mm, va, PAGE_SIZE) == 0) {
+            put_page(pg);
+            if (mm->rss) {
+                mm->rss--;
+            }
+        }
+    }
+}
+
+// map the file page behind addr, a private mapping gets its copy right away on a write
+static int file_fault(struct mm *mm, struct vma *v, uint64_t addr, int access) {
+    uint64_t va = addr & ~(PAGE_SIZE - 1);
+    char *data = (char *)v->obj + (va - v->start);
+    if (mmu_map(mm, va, virt_to_phys(data), PAGE_SIZE, v->prot) < 0) {
+        return -1;
+    }
+    mm->rss++;
+    if ((access & FAULT_WRITE) && (v->prot & PTE_COW)) {
+        return mmu_handle_cow(mm, va);
+    }
+    return 0;
+}
+
+// translation fault at addr, 0 when a zeroed page is now mapped there.
+// a stack only grows down to addr once that page is in
+int vma_fault(struct mm *mm, uint64_t addr, int access) {
+    int grow = 0;
+    struct vma *v = vma_find(mm, addr);
+    if (!v) {
+        v = stack_for(mm, addr);
+        if (!v) {
+            return -1;
+        }
+        grow = 1;
+    }
+
+    if ((access & FAULT_WRITE) && (v->prot & PTE_RDONLY) && !(v->prot & PTE_COW)) {
+        return -1;
+    }
+    if ((access & FAULT_EXEC) && (v->prot & PTE_UXN)) {
+        return -1;
+    }
+
+    if (v->flags & VMA_FILE) {
+        return file_fault(mm, v, addr, access);
+    }
+
+    void *page = page_alloc(0);
+    if (!page) {
+        uart_puts("vma: out of memory on fault\n");
+        return -1;
+    }
+    memset(page, 0, PAGE_SIZE);
+    if (mmu_map(mm, addr & ~(PAGE_SIZE - 1), virt_to_phys(page), PAGE_SIZE, v->prot) < 0) {
+        page_free(page);
+        return -1;
+    }
+    mm->rss++;
+    if (grow) {
+        v->start = addr & ~(PAGE_SIZE - 1);
+    }
+    return 0;
+}
+
+// drop a whole area: its pages, its backing object and the vma itself
+void vma_unmap(struct mm *mm, struct vma *v) {
+    struct vma **link = &mm->vmas;
+    while (*link && *link != v) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        return;
+    }
+    *link = v->next;
+
+    release_range(mm, v->start, v->end);
+    if (v->flags & VMA_SHM) {
+        shm_put(v->obj);
+    }
+    if (v->flags & VMA_FILE) {
+        vfs_map_put(v->obj);
+    }
+    pool_free(&vma_pool, v);
+}
+
+int vma_copy(struct mm *dst, struct mm *src) {
+    struct vma **link = &dst->vmas;
+    for (struct vma *v = src->vmas; v; v = v->next) {
+        struct vma *n = pool_alloc(&vma_pool);
+        if (!n) {
+            return -1;
+        }
+        *n = *v;
+        n->next = NULL;
+        if (n->flags & VMA_SHM) {
+            shm_get(n->obj);
+        }
+        if (n->flags & VMA_FILE) {
+            vfs_map_get(n->obj);
+        }
+        *link = n;
+        link = &n->next;
+    }
+    dst->brk_start = src->brk_start;
+    dst->brk = src->brk;
+    dst->rss = src->rss;
+    return 0;
+}
+
+// the page tables go with the address space, this only drops the list
+void vma_free_all(struct mm *mm) {
+    struct vma *v = mm->vmas;
+    while (v) {
+        struct vma *next = v->next;
+        if (v->flags & VMA_SHM) {
+            shm_put(v->obj);
+        }
+        if (v->flags & VMA_FILE) {
+            vfs_map_put(v->obj);
+        }
+        pool_free(&vma_pool, v);
+        v = next;
+    }
+    mm->vmas = NULL;
+}
+
+// move the program break, 0 queries. returns the break in effect afterwards
+uint64_t vma_brk(struct mm *mm, uint64_t new_brk) {
+    struct vma *heap = NULL;
+    for (struct vma *v = mm->vmas; v; v = v->next) {
+        if (v->flags & VMA_HEAP) {
+            heap = v;
+            break;
+        }
+    }
+    if (!heap || new_brk == 0 || new_brk < mm->brk_start) {
+        return mm->brk;
+    }
+
+    uint64_t end = PAGE_ALIGN(new_brk);
+    if (end > heap->end) {
+        // refuse to run into whatever is mapped above, stack guard included
+        struct vma *next = heap->next;
+        uint64_t limit = next ? next->start : USER_END;
+        if (next && (next->flags & VMA_GROWSDOWN)) {
+            limit = next->end - USER_STACK_MAX - USER_STACK_GUARD;
+        }
+        if (end > limit) {
+            return mm->brk;
+        }
+    } else if (end < heap->end) {
+        release_range(mm, end, heap->end);
+    }
+    heap->end = end;
+    mm->brk = new_brk;
+    return mm->brk;
+}
+
+// file data at kernel address data, size bytes, mapped lazily. returns the user address or 0
+uint64_t vma_map_file(struct mm *mm, void *data, size_t size, int flags) {
+    if (((uint64_t)data & (PAGE_SIZE - 1)) || size == 0) {
+        return 0;
+    }
+    uint64_t addr = vma_find_free(mm, size);
+    if (!addr) {
+        return 0;
+    }
+
+    // private pages start out shared with the file and are copied on the first write
+    uint64_t prot = PROT_USER_RO | PTE_SHARED;
+    if (flags & MAP_PRIVATE) {
+        prot = PROT_USER_RO | PTE_COW;
+    }
+    if (vma_add(mm, addr, addr + PAGE_ALIGN(size), prot, VMA_FILE) < 0) {
+        return 0;
+    }
+    vma_find(mm, addr)->obj = data;
+    return addr;
+}
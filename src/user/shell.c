@@ -3,6 +3,13 @@
 #include "process.h"  
 #include "string.h"   
 #include "vfs.h"     
+#include "kmalloc.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "fpsimd.h"
+#include "klog.h"
+#include "kprintf.h"
+#include "stats.h"
 #include <stddef.h>
 
 #define MAX_INPUT 256
@@ -33,9 +40,9 @@ void cmd_mv(char *args);
 void cmd_rm(char *args);
 void cmd_mkdir(char *args);
 void cmd_bind(char *args);
+void cmd_meminfo(char *args);
 
 
-extern struct process* current_process;  
 
 static struct {
     const char *name;
@@ -50,6 +57,7 @@ static struct {
     {"rm", cmd_rm},
     {"mkdir", cmd_mkdir},
     {"bind", cmd_bind},
+    {"meminfo", cmd_meminfo},
     {NULL, NULL}
 };
 
@@ -398,6 +406,74 @@ void cmd_bind(char *args) {
     uart_puts("\n");
 }
 
+static void print_stat(const char *label, uint64_t value) {
+    kprintf("%s%lu\n", label, (unsigned long)value);
+}
+
+// meminfo and sched are rendered by the kernel, the EL0 shell gets the same text
+static void print_report(const char *name, int which) {
+    static char buf[8192];
+    struct Message msg = {0};
+    msg.type = MSG_STATS;
+    msg.flags = which;
+    msg.data = buf;
+    msg.size = sizeof(buf);
+
+    if (send_message(&msg) < 0) {
+        uart_puts(name);
+        uart_puts(": failed\n");
+        return;
+    }
+    uart_puts(buf);
+}
+
+void cmd_meminfo(char *args) {
+    print_report("meminfo", STATS_MEM);
+}
+
+void cmd_dmesg(char *args) {
+    static char buf[8192];
+    struct Message msg = {0};
+    msg.type = MSG_KLOG;
+    msg.data = buf;
+    msg.size = sizeof(buf) - 1;
+
+    if (send_message(&msg) < 0) {
+        uart_puts("dmesg: failed\n");
+        return;
+    }
+    buf[msg.size] = '\0';
+    uart_puts(buf);
+}
+
+// loglevel [0-3]: err, warn, info, debug
+void cmd_loglevel(char *args) {
+    struct Message msg = {0};
+    msg.type = MSG_KLOG_LEVEL;
+    msg.flags = -1;
+    if (args && args[0] >= '0' && args[0] <= '3') {
+        msg.flags = args[0] - '0';
+    } else if (args && args[0]) {
+        uart_puts("Usage: loglevel [0-3]\n");
+        return;
+    }
+    if (send_message(&msg) < 0) {
+        uart_puts("loglevel: failed\n");
+        return;
+    }
+
+    struct klog_stats st;
+    klog_get_stats(&st);
+    print_stat("level:               ", msg.flags < 0 ? msg.status : msg.flags);
+    print_stat("records written:     ", st.written);
+    print_stat("records printed:     ", st.printed);
+    print_stat("records dropped:     ", st.dropped);
+}
+
+void cmd_sched(char *args) {
+    print_report("sched", STATS_SCHED);
+}
+
 void shell(void) {
     char input[MAX_INPUT];
     int pos = 0;
@@ -460,6 +536,14 @@ void shell(void) {
             cmd_mkdir(args);
         } else if (strcmp(cmd, "bind") == 0) {
             cmd_bind(args);
+        } else if (strcmp(cmd, "meminfo") == 0) {
+            cmd_meminfo(args);
+        } else if (strcmp(cmd, "sched") == 0) {
+            cmd_sched(args);
+        } else if (strcmp(cmd, "dmesg") == 0) {
+            cmd_dmesg(args);
+        } else if (strcmp(cmd, "loglevel") == 0) {
+            cmd_loglevel(args);
         } else if (strcmp(cmd, "unbind") == 0) {
             if (!args) {
                 uart_puts("Usage: unbind <path>\n");